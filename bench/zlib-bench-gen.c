@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+/*
+ * Deterministic zlib workload for the benchmark corpus.  Run under
+ * zlib-record, it produces one trace per stream; the stream numbers, and
+ * therefore the trace names, are the same on every run.
+ */
+
+#define DATA_SIZE (256 << 10)
+#define CHUNK_SIZE (16 << 10)
+
+static const char *argv0;
+static Bytef *data;
+static Bytef *compressed;
+static Bytef *scratch;
+static uint64_t bytes;
+
+#define check(x)                                                              \
+  do                                                                          \
+    {                                                                         \
+      int err_ = (x);                                                         \
+      if (err_ < 0 && err_ != Z_BUF_ERROR)                                    \
+        {                                                                     \
+          fprintf (stderr, "%s:%d: %s: %i\n", argv0, __LINE__, #x, err_);     \
+          exit (EXIT_FAILURE);                                                \
+        }                                                                     \
+    }                                                                         \
+  while (0)
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Text-like data with some binary runs, from a fixed-seed xorshift. */
+static void
+generate (void)
+{
+  static const char *const words[]
+      = { "the ",    "zlib ",  "stream ",    "of ",     "deflate ",
+          "window ", "and ",   "inflate ",   "to ",     "buffer ",
+          "a ",      "level ", "strategy ",  "block ",  "header ",
+          "flush ",  "in ",    "huffman ",   "match ",  "length ",
+          "\n",      "{\"id\": ", "\"name\": ", "}, ", "0123456789" };
+  uint64_t x = 0x9e3779b97f4a7c15;
+  size_t pos = 0;
+  size_t len;
+  size_t i;
+
+  while (pos < DATA_SIZE)
+    {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      if (x % 64 == 0)
+        {
+          len = 64 + x % 512;
+          for (i = 0; i < len && pos < DATA_SIZE; i++)
+            data[pos++] = (Bytef)(x >> (i % 56));
+          continue;
+        }
+      len = strlen (words[x % (sizeof (words) / sizeof (words[0]))]);
+      if (len > DATA_SIZE - pos)
+        len = DATA_SIZE - pos;
+      memcpy (data + pos, words[x % (sizeof (words) / sizeof (words[0]))],
+              len);
+      pos += len;
+    }
+}
+
+/*
+ * Compress data in CHUNK_SIZE pieces, flushing each with flush, and return
+ * the compressed size.  With params, the level changes every chunk.
+ */
+static size_t
+compress_chunks (z_streamp strm, int flush, int params)
+{
+  size_t pos;
+  size_t n;
+
+  strm->next_out = compressed;
+  strm->avail_out = deflateBound (strm, DATA_SIZE) + DATA_SIZE / 16;
+  for (pos = 0; pos < DATA_SIZE; pos += n)
+    {
+      n = DATA_SIZE - pos < CHUNK_SIZE ? DATA_SIZE - pos : CHUNK_SIZE;
+      if (params)
+        check (deflateParams (strm, (int)(pos / CHUNK_SIZE % 10),
+                              Z_DEFAULT_STRATEGY));
+      strm->next_in = data + pos;
+      strm->avail_in = (uInt)n;
+      check (deflate (strm, pos + n == DATA_SIZE ? Z_FINISH : flush));
+    }
+  bytes += DATA_SIZE;
+  return strm->total_out;
+}
+
+/* Decompress with output buffers of out_size and the given flush mode. */
+static void
+decompress (z_streamp strm, size_t len, size_t out_size, int flush)
+{
+  int err = Z_OK;
+
+  strm->next_in = compressed;
+  strm->avail_in = (uInt)len;
+  while (err != Z_STREAM_END)
+    {
+      strm->next_out = scratch;
+      strm->avail_out = (uInt)out_size;
+      err = inflate (strm, flush);
+      check (err);
+      if (err == Z_BUF_ERROR && strm->avail_in == 0)
+        break;
+    }
+  bytes += strm->total_out;
+}
+
+static size_t
+deflate_one (int level, int window_bits, int mem_level, int strategy,
+             int flush, int params)
+{
+  z_stream strm;
+  size_t len;
+
+  memset (&strm, 0, sizeof (strm));
+  check (deflateInit2 (&strm, level, Z_DEFLATED, window_bits, mem_level,
+                       strategy));
+  len = compress_chunks (&strm, flush, params);
+  check (deflateEnd (&strm));
+  return len;
+}
+
+static void
+inflate_one (size_t len, int window_bits, size_t out_size, int flush)
+{
+  z_stream strm;
+
+  memset (&strm, 0, sizeof (strm));
+  check (inflateInit2 (&strm, window_bits));
+  decompress (&strm, len, out_size, flush);
+  check (inflateEnd (&strm));
+}
+
+/* Compress the first half, copy, and finish both the original and copy. */
+static void
+copies (void)
+{
+  z_stream strm;
+  z_stream copy;
+  size_t len;
+
+  memset (&strm, 0, sizeof (strm));
+  check (deflateInit (&strm, 6));
+  strm.next_in = data;
+  strm.avail_in = DATA_SIZE / 2;
+  strm.next_out = compressed;
+  strm.avail_out = deflateBound (&strm, DATA_SIZE);
+  check (deflate (&strm, Z_NO_FLUSH));
+  check (deflateCopy (&copy, &strm));
+  strm.avail_in = DATA_SIZE / 2;
+  check (deflate (&strm, Z_FINISH));
+  copy.next_in = data;
+  copy.avail_in = DATA_SIZE / 4;
+  copy.next_out = scratch;
+  copy.avail_out = deflateBound (&copy, DATA_SIZE);
+  check (deflate (&copy, Z_FINISH));
+  len = strm.total_out;
+  check (deflateEnd (&copy));
+  check (deflateEnd (&strm));
+  bytes += DATA_SIZE + DATA_SIZE / 4;
+
+  memset (&strm, 0, sizeof (strm));
+  check (inflateInit (&strm));
+  strm.next_in = compressed;
+  strm.avail_in = (uInt)len / 2;
+  strm.next_out = scratch;
+  strm.avail_out = DATA_SIZE;
+  check (inflate (&strm, Z_NO_FLUSH));
+  check (inflateCopy (&copy, &strm));
+  strm.avail_in = (uInt)(len - len / 2);
+  check (inflate (&strm, Z_FINISH));
+  copy.avail_in = (uInt)(len - len / 2);
+  copy.next_out = scratch;
+  copy.avail_out = DATA_SIZE;
+  check (inflate (&copy, Z_FINISH));
+  bytes += strm.total_out + copy.total_out;
+  check (inflateEnd (&copy));
+  check (inflateEnd (&strm));
+}
+
+/* Reuse one stream of each kind for several small messages. */
+static void
+resets (void)
+{
+  z_stream d;
+  z_stream i;
+  size_t pos;
+  int n;
+
+  memset (&d, 0, sizeof (d));
+  memset (&i, 0, sizeof (i));
+  check (deflateInit (&d, 6));
+  check (inflateInit (&i));
+  for (pos = 0; pos + 4096 <= DATA_SIZE / 4; pos += 4096)
+    {
+      check (deflateReset (&d));
+      d.next_in = data + pos;
+      d.avail_in = 4096;
+      d.next_out = compressed;
+      d.avail_out = deflateBound (&d, 4096);
+      check (deflate (&d, Z_FINISH));
+      n = (int)(d.next_out - compressed);
+      check (inflateReset (&i));
+      i.next_in = compressed;
+      i.avail_in = n;
+      i.next_out = scratch;
+      i.avail_out = 4096;
+      check (inflate (&i, Z_FINISH));
+      bytes += 2 * 4096;
+    }
+  check (deflateEnd (&d));
+  check (inflateEnd (&i));
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int strategies[]
+      = { Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED };
+  static const int flushes[]
+      = { Z_PARTIAL_FLUSH, Z_SYNC_FLUSH, Z_FULL_FLUSH, Z_BLOCK };
+  uint64_t start;
+  size_t len;
+  size_t i;
+  int level;
+
+  (void)argc;
+  argv0 = argv[0];
+  data = malloc (DATA_SIZE);
+  compressed = malloc (2 * DATA_SIZE);
+  scratch = malloc (2 * DATA_SIZE);
+  if (!data || !compressed || !scratch)
+    {
+      fprintf (stderr, "%s: oom\n", argv0);
+      return EXIT_FAILURE;
+    }
+  generate ();
+  start = now_ns ();
+  for (level = 0; level <= 9; level++)
+    {
+      len = deflate_one (level, MAX_WBITS, 8, Z_DEFAULT_STRATEGY, Z_NO_FLUSH,
+                         0);
+      inflate_one (len, MAX_WBITS, CHUNK_SIZE, Z_NO_FLUSH);
+    }
+  for (i = 0; i < sizeof (strategies) / sizeof (strategies[0]); i++)
+    deflate_one (6, MAX_WBITS, 8, strategies[i], Z_NO_FLUSH, 0);
+  for (i = 0; i < sizeof (flushes) / sizeof (flushes[0]); i++)
+    {
+      len = deflate_one (6, MAX_WBITS, 8, Z_DEFAULT_STRATEGY, flushes[i], 0);
+      inflate_one (len, MAX_WBITS, 4096, flushes[i] == Z_BLOCK ? Z_BLOCK
+                                                               : Z_SYNC_FLUSH);
+    }
+  len = deflate_one (9, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY, Z_NO_FLUSH, 0);
+  inflate_one (len, -MAX_WBITS, DATA_SIZE, Z_FINISH);
+  len = deflate_one (1, MAX_WBITS + 16, 1, Z_DEFAULT_STRATEGY, Z_NO_FLUSH, 0);
+  inflate_one (len, MAX_WBITS + 32, 1024, Z_NO_FLUSH);
+  len = deflate_one (6, 9, 8, Z_DEFAULT_STRATEGY, Z_NO_FLUSH, 0);
+  inflate_one (len, 9, CHUNK_SIZE, Z_NO_FLUSH);
+  deflate_one (6, MAX_WBITS, 8, Z_DEFAULT_STRATEGY, Z_NO_FLUSH, 1);
+  copies ();
+  resets ();
+  printf ("{\"bytes\": %llu, \"ns\": %llu}\n", (unsigned long long)bytes,
+          (unsigned long long)(now_ns () - start));
+  free (scratch);
+  free (compressed);
+  free (data);
+  return EXIT_SUCCESS;
+}
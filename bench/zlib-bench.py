@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+"""Record the benchmark corpus, replay it and compare throughput with a
+baseline.
+
+Traces contain the exact output of the zlib that recorded them, so the corpus
+is regenerated on every run by zlib-bench-gen rather than stored. Throughput
+of each trace is the best of several rounds, in uncompressed MB per second of
+replay time, which includes parsing and verification. Recording throughput is
+that of zlib-bench-gen running under the recorder in flight-recorder mode,
+which has the same hot path minus the writes and fsyncs, whose timing depends
+on the disk.
+
+Single traces are too short to be compared reliably, so the test fails on the
+geometric mean of the per-trace changes, and on the recording throughput.
+Without a baseline, the test exits with SKIP_RETURN_CODE; only --update
+writes one.
+"""
+import argparse
+import json
+import math
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+TRACE_RE = re.compile(r"^(deflate|inflate)\.(\d+)\.(\d+)$")
+SKIP_RETURN_CODE = 77
+
+
+def run_generator(args, workdir, env=None):
+    if os.path.exists(workdir):
+        shutil.rmtree(workdir)
+    os.makedirs(workdir)
+    out = subprocess.run(
+        [args.record, args.generator],
+        cwd=workdir,
+        env=env,
+        check=True,
+        stdout=subprocess.PIPE,
+    ).stdout
+    result = json.loads(out)
+    return result["bytes"] / result["ns"] * 1e3
+
+
+def stream_key(name):
+    kind, stream = name.split(".")
+    return kind, int(stream)
+
+
+def list_traces(corpus):
+    """Map stable names (kind.stream) to trace file names."""
+    traces = {}
+    for name in os.listdir(corpus):
+        m = TRACE_RE.match(name)
+        if m:
+            traces["{}.{}".format(m.group(1), m.group(3))] = name
+    return {name: traces[name] for name in sorted(traces, key=stream_key)}
+
+
+def replay(args, corpus, traces, extra):
+    out = subprocess.run(
+        [args.replay] + extra + list(traces.values()),
+        cwd=corpus,
+        check=True,
+        stdout=subprocess.PIPE,
+    ).stdout
+    return out
+
+
+def measure(args):
+    corpus = os.path.join(args.workdir, "corpus")
+    scratch = os.path.join(args.workdir, "scratch")
+    run_generator(args, corpus)
+    results = {"record": 0, "traces": {}}
+    flight = dict(os.environ, ZLIB_RECORD_FLIGHT="64")
+    # Runs are short, so take more of them.
+    for _ in range(2 * args.rounds):
+        mbps = run_generator(args, scratch, flight)
+        results["record"] = max(results["record"], mbps)
+    shutil.rmtree(scratch, ignore_errors=True)
+    traces = list_traces(corpus)
+    if not traces:
+        sys.exit("no traces were recorded")
+    # Correctness first: every trace must replay as recorded.
+    replay(args, corpus, traces, [])
+    by_file = {v: k for k, v in traces.items()}
+    for _ in range(args.rounds):
+        timings = json.loads(
+            replay(args, corpus, traces, ["-t", "-n", str(args.count)])
+        )
+        for t in timings:
+            name = by_file[t["trace"]]
+            mbps = t["bytes"] / t["replay_ns"] * 1e3 if t["replay_ns"] else 0
+            results["traces"][name] = max(results["traces"].get(name, 0), mbps)
+    return results
+
+
+def print_row(name, old, new, change, flag=""):
+    print(
+        "{:<16} {:>12.1f} {:>12.1f} {:>+8.1f}%{}".format(
+            name, old, new, change, flag
+        )
+    )
+
+
+def compare(baseline, results, tolerance):
+    regressions = []
+    log_sum = 0.0
+    n = 0
+    print("{:<16} {:>12} {:>12} {:>9}".format("", "baseline", "MB/s", "change"))
+    for name, new in results["traces"].items():
+        old = baseline.get("traces", {}).get(name)
+        if not old or not new:
+            print("{:<16} {:>12} {:>12.1f} {:>9}".format(name, "-", new, "new"))
+            continue
+        print_row(name, old, new, 100.0 * new / old - 100)
+        log_sum += math.log(new / old)
+        n += 1
+    for name, change in (
+        ("replay", 100.0 * math.exp(log_sum / n) - 100 if n else 0.0),
+        (
+            "record",
+            100.0 * results["record"] / baseline["record"] - 100
+            if baseline.get("record")
+            else 0.0,
+        ),
+    ):
+        flag = ""
+        if change < -tolerance:
+            regressions.append(name)
+            flag = " REGRESSION"
+        print("{:<16} {:>+35.1f}%{}".format(name, change, flag))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--record", required=True, help="zlib-record script")
+    parser.add_argument("--replay", required=True, help="zlib-replay binary")
+    parser.add_argument("--generator", required=True, help="zlib-bench-gen")
+    parser.add_argument("--baseline", required=True, help="baseline JSON file")
+    parser.add_argument("--workdir", required=True)
+    parser.add_argument(
+        "--tolerance", type=float, default=15, help="allowed slowdown, %%"
+    )
+    parser.add_argument("--rounds", type=int, default=5)
+    parser.add_argument("--count", type=int, default=3, help="replays per round")
+    parser.add_argument(
+        "--update", action="store_true", help="store the results as baseline"
+    )
+    args = parser.parse_args()
+
+    if not args.update and not os.path.exists(args.baseline):
+        print(
+            "no baseline at {}, store one with --update".format(args.baseline)
+        )
+        return SKIP_RETURN_CODE
+    results = measure(args)
+    if args.update:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("baseline written to {}".format(args.baseline))
+        return 0
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    regressions = compare(baseline, results, args.tolerance)
+    if regressions:
+        print(
+            "slower than the baseline by more than {}%: {}".format(
+                args.tolerance, ", ".join(regressions)
+            )
+        )
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <uthash.h>
+
+#include "zlib-record-ring.h"
+
+#define die(fmt, ...)                                                         \
+  do                                                                          \
+    {                                                                         \
+      fprintf (stderr, "zlib-collector: " fmt "\n", ##__VA_ARGS__);           \
+      exit (EXIT_FAILURE);                                                    \
+    }                                                                         \
+  while (0)
+
+#define MAX_CLIENTS 1024
+
+struct stream
+{
+  uint64_t counter;
+  int fds[3]; /* indexed by enum ring_file */
+  UT_hash_handle hh;
+};
+
+/*
+ * Clients are not trusted: a malformed ring gets its client dropped, and the
+ * ring size is taken from the hello rather than from the shared ring.
+ */
+struct client
+{
+  int sock;
+  unsigned long pid;
+  struct ring *ring;
+  uint64_t size;
+  struct stream *streams;
+};
+
+static struct client clients[MAX_CLIENTS];
+static int n_clients;
+static volatile sig_atomic_t stop;
+
+static int
+creat_or_die (const char *path)
+{
+  int fd;
+
+  fd = creat (path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if (fd == -1)
+    die ("creat(%s) failed", path);
+  return fd;
+}
+
+static void
+write_or_die (int fd, const void *buf, size_t count)
+{
+  ssize_t ret;
+
+  while (count)
+    {
+      ret = write (fd, buf, count);
+      if (ret <= 0)
+        die ("write() failed");
+      buf = (const char *)buf + ret;
+      count -= ret;
+    }
+}
+
+static void
+close_stream_or_die (struct client *client, struct stream *stream)
+{
+  int i;
+
+  HASH_DELETE (hh, client->streams, stream);
+  for (i = 0; i < 3; i++)
+    {
+      if (fsync (stream->fds[i]) < 0)
+        die ("fsync() failed");
+      if (close (stream->fds[i]) < 0)
+        die ("close() failed");
+    }
+  free (stream);
+}
+
+static int
+open_stream_or_die (struct client *client, uint64_t counter, const char *name)
+{
+  struct stream *stream;
+  char *path;
+
+  HASH_FIND (hh, client->streams, &counter, sizeof (uint64_t), stream);
+  if (stream || !*name || strchr (name, '/'))
+    {
+      fprintf (stderr, "zlib-collector: pid %lu: bad stream %" PRIu64 "\n",
+               client->pid, counter);
+      return EXIT_FAILURE;
+    }
+  stream = calloc (1, sizeof (*stream));
+  path = malloc (strlen (name) + sizeof (".out"));
+  if (!stream || !path)
+    die ("oom");
+  stream->counter = counter;
+  sprintf (path, "%s.in", name);
+  stream->fds[RING_IN] = creat_or_die (path);
+  sprintf (path, "%s.out", name);
+  stream->fds[RING_OUT] = creat_or_die (path);
+  stream->fds[RING_META] = creat_or_die (name);
+  free (path);
+  HASH_ADD (hh, client->streams, counter, sizeof (uint64_t), stream);
+  return EXIT_SUCCESS;
+}
+
+static struct stream *
+find_stream (struct client *client, uint64_t counter)
+{
+  struct stream *stream;
+
+  HASH_FIND (hh, client->streams, &counter, sizeof (uint64_t), stream);
+  if (!stream)
+    fprintf (stderr, "zlib-collector: pid %lu: unknown stream %" PRIu64 "\n",
+             client->pid, counter);
+  return stream;
+}
+
+/* Like ring_copy_out (), but with the size from the hello. */
+static void
+copy_out (const struct client *client, uint64_t pos, void *buf, uint64_t len)
+{
+  uint64_t off = pos & (client->size - 1);
+  uint64_t n = len < client->size - off ? len : client->size - off;
+
+  memcpy (buf, client->ring->data + off, n);
+  memcpy ((char *)buf + n, client->ring->data, len - n);
+}
+
+/*
+ * Write out everything the client has published so far.  Returns 1 if there
+ * was something, 0 if not, and -1 if the ring is malformed.
+ */
+static int
+drain_or_die (struct client *client)
+{
+  struct ring *ring = client->ring;
+  struct ring_record record;
+  struct stream *stream;
+  char name[256];
+  uint64_t head;
+  uint64_t tail;
+  uint64_t off;
+  uint64_t n;
+  int ret = 1;
+
+  head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  if (head == tail)
+    return 0;
+  if (head - tail > client->size || (head - tail) % 8 != 0)
+    {
+      fprintf (stderr, "zlib-collector: pid %lu: bad ring position\n",
+               client->pid);
+      return -1;
+    }
+  while (tail != head)
+    {
+      if (head - tail < sizeof (record))
+        goto bad_record;
+      copy_out (client, tail, &record, sizeof (record));
+      if (record.len > head - tail - sizeof (record)
+          || RING_ALIGN (record.len) > head - tail - sizeof (record))
+        goto bad_record;
+      tail += sizeof (record);
+      switch (record.type)
+        {
+        case RING_OPEN:
+          if (record.len >= sizeof (name))
+            goto bad_record;
+          copy_out (client, tail, name, record.len);
+          name[record.len] = 0;
+          if (open_stream_or_die (client, record.stream, name)
+              != EXIT_SUCCESS)
+            goto fail;
+          break;
+        case RING_DATA:
+          if (record.file > RING_META)
+            goto bad_record;
+          stream = find_stream (client, record.stream);
+          if (!stream)
+            goto fail;
+          off = tail & (client->size - 1);
+          n = record.len < client->size - off ? record.len
+                                              : client->size - off;
+          write_or_die (stream->fds[record.file], ring->data + off, n);
+          write_or_die (stream->fds[record.file], ring->data,
+                        record.len - n);
+          break;
+        case RING_CLOSE:
+          stream = find_stream (client, record.stream);
+          if (!stream)
+            goto fail;
+          close_stream_or_die (client, stream);
+          break;
+        default:
+          goto bad_record;
+        }
+      tail += RING_ALIGN (record.len);
+    }
+  goto done;
+bad_record:
+  fprintf (stderr, "zlib-collector: pid %lu: bad record\n", client->pid);
+fail:
+  ret = -1;
+done:
+  atomic_store_explicit (&ring->tail, tail, memory_order_release);
+  return ret;
+}
+
+static void
+accept_or_die (int listen_sock)
+{
+  struct client *client;
+  int sock;
+
+  sock = accept4 (listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sock == -1)
+    {
+      if (errno == EAGAIN || errno == ECONNABORTED || errno == EINTR)
+        return;
+      die ("accept() failed");
+    }
+  if (n_clients == MAX_CLIENTS)
+    {
+      fprintf (stderr, "zlib-collector: too many clients\n");
+      close (sock);
+      return;
+    }
+  client = &clients[n_clients++];
+  memset (client, 0, sizeof (*client));
+  client->sock = sock;
+}
+
+/*
+ * Map the client's ring once its hello has arrived in full; until then, the
+ * client stays unregistered.  The socket is non-blocking, so that a slow
+ * client does not hold up the others.
+ */
+static int
+register_client (struct client *client)
+{
+  struct ring_hello hello;
+  struct stat st;
+  ssize_t n;
+  struct iovec iov;
+  struct msghdr msg;
+  union
+  {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  struct cmsghdr *cmsg;
+  int fd;
+
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof (hello);
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+  n = recv (client->sock, &hello, sizeof (hello), MSG_PEEK);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return EXIT_SUCCESS;
+  if (n > 0 && (size_t)n < sizeof (hello))
+    return EXIT_SUCCESS;
+  if (n <= 0 || recvmsg (client->sock, &msg, 0) != sizeof (hello)
+      || hello.magic != RING_MAGIC)
+    {
+      fprintf (stderr, "zlib-collector: bad hello\n");
+      return EXIT_FAILURE;
+    }
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+      fprintf (stderr, "zlib-collector: pid %lu: no ring fd\n",
+               (unsigned long)hello.pid);
+      return EXIT_FAILURE;
+    }
+  memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+  client->pid = hello.pid;
+  if (hello.size < 4096 || hello.size > (1ULL << 40)
+      || (hello.size & (hello.size - 1)) != 0 || fstat (fd, &st) < 0
+      || (uint64_t)st.st_size < sizeof (struct ring) + hello.size)
+    {
+      close (fd);
+      fprintf (stderr, "zlib-collector: pid %lu: bad ring size\n",
+               client->pid);
+      return EXIT_FAILURE;
+    }
+  client->size = hello.size;
+  client->ring = mmap (NULL, sizeof (struct ring) + hello.size,
+                       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (client->ring == MAP_FAILED)
+    {
+      client->ring = NULL;
+      fprintf (stderr, "zlib-collector: pid %lu: mmap() failed\n",
+               client->pid);
+      return EXIT_FAILURE;
+    }
+  if (client->ring->magic != RING_MAGIC || client->ring->size != hello.size)
+    {
+      munmap (client->ring, sizeof (struct ring) + hello.size);
+      client->ring = NULL;
+      fprintf (stderr, "zlib-collector: pid %lu: bad ring\n", client->pid);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+
+/* Clients send nothing after the hello, so readable means closed. */
+static int
+client_gone (struct client *client)
+{
+  char c;
+  ssize_t n;
+
+  n = recv (client->sock, &c, 1, 0);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR);
+}
+
+/*
+ * The process is gone, or sent garbage: flush what is left, unless the ring
+ * is malformed, and close its streams.
+ */
+static void
+disconnect_or_die (int i, int drain)
+{
+  struct client *client = &clients[i];
+  struct stream *stream;
+  struct stream *tmp;
+
+  if (client->ring)
+    {
+      if (drain)
+        drain_or_die (client);
+      HASH_ITER (hh, client->streams, stream, tmp)
+      {
+        close_stream_or_die (client, stream);
+      }
+      munmap (client->ring, sizeof (struct ring) + client->size);
+    }
+  close (client->sock);
+  *client = clients[--n_clients];
+}
+
+static void
+handle_signal (int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  struct pollfd pfds[MAX_CLIENTS + 1];
+  struct sigaction sa;
+  int listen_sock;
+  int busy = 0;
+  int ret;
+  int i;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "Usage: %s SOCKET\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = handle_signal;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  listen_sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_sock == -1)
+    die ("socket() failed");
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (argv[1]) >= sizeof (addr.sun_path))
+    die ("socket path is too long: %s", argv[1]);
+  strcpy (addr.sun_path, argv[1]);
+  unlink (argv[1]); /* stale socket, ignore rc */
+  if (bind (listen_sock, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+    die ("could not bind to %s", argv[1]);
+  if (listen (listen_sock, SOMAXCONN) < 0)
+    die ("listen() failed");
+
+  while (!stop)
+    {
+      pfds[0].fd = listen_sock;
+      pfds[0].events = POLLIN;
+      for (i = 0; i < n_clients; i++)
+        {
+          pfds[i + 1].fd = clients[i].sock;
+          pfds[i + 1].events = POLLIN;
+        }
+      /* Rings are polled, so only sleep when there was nothing to do. */
+      if (poll (pfds, n_clients + 1, busy ? 0 : 10) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          die ("poll() failed");
+        }
+      busy = 0;
+      for (i = n_clients - 1; i >= 0; i--)
+        {
+          if (!(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+          if (clients[i].ring ? client_gone (&clients[i])
+                              : register_client (&clients[i]) != EXIT_SUCCESS)
+            disconnect_or_die (i, 1);
+        }
+      if (pfds[0].revents & POLLIN)
+        accept_or_die (listen_sock);
+      for (i = n_clients - 1; i >= 0; i--)
+        {
+          if (!clients[i].ring)
+            continue;
+          ret = drain_or_die (&clients[i]);
+          if (ret < 0)
+            disconnect_or_die (i, 0);
+          else
+            busy |= ret;
+        }
+    }
+  while (n_clients)
+    disconnect_or_die (n_clients - 1, 1);
+  unlink (argv[1]);
+  return EXIT_SUCCESS;
+}
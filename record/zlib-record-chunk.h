@@ -0,0 +1,67 @@
+#ifndef ZLIB_RECORD_CHUNK_H
+#define ZLIB_RECORD_CHUNK_H
+
+/*
+ * Deduplicated payloads.  With ZLIB_RECORD_DEDUP=STORE, libz-record cuts the
+ * input and output of each stream into content-defined chunks and writes
+ * every distinct chunk once, to STORE/XX/HASH, where HASH is chunk_hash ()
+ * in hex and XX its first two digits.  Instead of NAME.in and NAME.out,
+ * the trace gets NAME.in.chunks and NAME.out.chunks, which list the chunks
+ * to concatenate:
+ *
+ *   s STORE
+ *   HASH LEN
+ *   ...
+ *
+ * A relative STORE is relative to the directory of the trace.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHUNK_MIN_SIZE 2048
+#define CHUNK_MAX_SIZE 65536
+/* A boundary is where the rolling hash has these bits clear: avg 8 KiB. */
+#define CHUNK_MASK 0x1fff
+#define CHUNK_SUFFIX ".chunks"
+
+static inline uint64_t
+chunk_mix (uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Little-endian, so that stores can be shared between machines. */
+static inline uint64_t
+chunk_load (const unsigned char *p, size_t n)
+{
+  uint64_t v = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+static inline uint64_t
+chunk_hash (const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+
+  for (; len >= 8; p += 8, len -= 8)
+    {
+      h ^= chunk_mix (chunk_load (p, 8));
+      h = ((h << 31) | (h >> 33)) * 0x9fb21c651e98df25ULL;
+    }
+  if (len)
+    h ^= chunk_mix (chunk_load (p, len) ^ ((uint64_t)len << 56));
+  return chunk_mix (h);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef ZLIB_RECORD_RING_H
+#define ZLIB_RECORD_RING_H
+
+/*
+ * Shared-memory ring through which libz-record hands trace data over to
+ * zlib-collector.  Each recorded process owns one ring: it is the only
+ * producer, and the collector is the only consumer.  The ring's file
+ * descriptor is passed to the collector over a Unix socket together with a
+ * ring_hello message.  The connection stays open for the lifetime of the
+ * process, so that the collector notices when the process goes away.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RING_MAGIC 0x7a726e67 /* "zrng" */
+#define RING_DEFAULT_SIZE (8UL << 20)
+
+enum ring_record_type
+{
+  RING_OPEN,  /* payload: trace base name, e.g. "deflate.PID.STREAM" */
+  RING_DATA,  /* payload: bytes to append to ring_record.file */
+  RING_CLOSE, /* no payload */
+};
+
+enum ring_file
+{
+  RING_IN,
+  RING_OUT,
+  RING_META,
+};
+
+struct ring_hello
+{
+  uint32_t magic;
+  uint32_t pid;
+  uint64_t size;
+};
+
+struct ring_record
+{
+  uint32_t type;
+  uint32_t file;
+  uint64_t stream;
+  uint64_t len;
+};
+
+struct ring
+{
+  uint32_t magic;
+  uint64_t size; /* power of 2 */
+  _Alignas (64) _Atomic uint64_t head;
+  _Alignas (64) _Atomic uint64_t tail;
+  _Alignas (64) unsigned char data[];
+};
+
+#define RING_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+static inline void
+ring_copy_in (struct ring *ring, uint64_t pos, const void *buf, uint64_t len)
+{
+  uint64_t off = pos & (ring->size - 1);
+  uint64_t n = len < ring->size - off ? len : ring->size - off;
+
+  memcpy (ring->data + off, buf, n);
+  memcpy (ring->data, (const char *)buf + n, len - n);
+}
+
+static inline void
+ring_copy_out (const struct ring *ring, uint64_t pos, void *buf, uint64_t len)
+{
+  uint64_t off = pos & (ring->size - 1);
+  uint64_t n = len < ring->size - off ? len : ring->size - off;
+
+  memcpy (buf, ring->data + off, n);
+  memcpy ((char *)buf + n, ring->data, len - n);
+}
+
+#endif
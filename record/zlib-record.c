@@ -1,15 +1,29 @@
 #define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <uthash.h>
 #include <zlib.h>
 
+#include "zlib-record-chunk.h"
+#include "zlib-record-ring.h"
+
 #ifdef __APPLE__
 #include "dyld-interposing.h"
 #define ORIG(x) x
@@ -40,7 +54,7 @@ creat_or_die (const char *path)
 }
 
 static void
-write_or_die (int fd, const void *buf, size_t count)
+write_all_or_die (int fd, const void *buf, size_t count)
 {
   ssize_t ret;
 
@@ -52,11 +66,22 @@ write_or_die (int fd, const void *buf, size_t count)
       buf = (const char *)buf + ret;
       count -= ret;
     }
-  ret = fsync (fd);
-  if (ret < 0)
+}
+
+static void
+fsync_or_die (int fd)
+{
+  if (fsync (fd) < 0)
     die ("fsync() failed");
 }
 
+static void
+write_or_die (int fd, const void *buf, size_t count)
+{
+  write_all_or_die (fd, buf, count);
+  fsync_or_die (fd);
+}
+
 static void
 close_or_die (int fd)
 {
@@ -64,10 +89,240 @@ close_or_die (int fd)
     die ("close() failed");
 }
 
+/*
+ * Each recorded stream allocates through alloc_wrapper () and free_wrapper (),
+ * which account for the memory and forward to the allocator that the stream
+ * was initialized with.  strm->opaque points to the stream's alloc_stats.
+ */
+struct alloc_entry
+{
+  voidpf address;
+  unsigned long size;
+  UT_hash_handle hh;
+};
+
+/* zlib makes at most 5 allocations per stream; more go to entries. */
+#define ALLOC_SLOTS 8
+
+struct alloc_slot
+{
+  voidpf address; /* NULL if free */
+  unsigned long size;
+};
+
+struct alloc_stats
+{
+  alloc_func zalloc;
+  free_func zfree;
+  voidpf opaque;
+  unsigned long allocs;
+  unsigned long bytes;
+  unsigned long live;
+  unsigned long peak;
+  struct alloc_slot slots[ALLOC_SLOTS];
+  struct alloc_entry *entries;
+};
+
+/* Set while deflateCopy () or inflateCopy () allocates for the new stream. */
+static _Thread_local struct alloc_stats *alloc_redirect;
+
+static voidpf
+alloc_wrapper (voidpf opaque, uInt items, uInt size)
+{
+  struct alloc_stats *stats = alloc_redirect ? alloc_redirect : opaque;
+  struct alloc_slot *slot = NULL;
+  struct alloc_entry *entry = NULL;
+  voidpf address;
+  int i;
+
+  for (i = 0; i < ALLOC_SLOTS && !slot; i++)
+    if (!stats->slots[i].address)
+      slot = &stats->slots[i];
+  if (!slot)
+    {
+      entry = malloc (sizeof (*entry));
+      if (!entry)
+        return Z_NULL;
+    }
+  address = stats->zalloc ? stats->zalloc (stats->opaque, items, size)
+                          : malloc ((size_t)items * size);
+  if (!address)
+    {
+      free (entry);
+      return Z_NULL;
+    }
+  if (slot)
+    {
+      slot->address = address;
+      slot->size = (unsigned long)items * size;
+    }
+  else
+    {
+      entry->address = address;
+      entry->size = (unsigned long)items * size;
+      HASH_ADD (hh, stats->entries, address, sizeof (voidpf), entry);
+    }
+  stats->allocs++;
+  stats->bytes += (unsigned long)items * size;
+  stats->live += (unsigned long)items * size;
+  if (stats->live > stats->peak)
+    stats->peak = stats->live;
+  return address;
+}
+
+static void
+free_wrapper (voidpf opaque, voidpf address)
+{
+  struct alloc_stats *stats = alloc_redirect ? alloc_redirect : opaque;
+  struct alloc_entry *entry = NULL;
+  int i;
+
+  for (i = 0; i < ALLOC_SLOTS; i++)
+    if (address && stats->slots[i].address == address)
+      break;
+  if (i < ALLOC_SLOTS)
+    {
+      stats->live -= stats->slots[i].size;
+      stats->slots[i].address = NULL;
+    }
+  else if (stats->entries)
+    HASH_FIND (hh, stats->entries, &address, sizeof (voidpf), entry);
+  if (entry)
+    {
+      stats->live -= entry->size;
+      HASH_DELETE (hh, stats->entries, entry);
+      free (entry);
+    }
+  if (stats->zfree)
+    stats->zfree (stats->opaque, address);
+  else
+    free (address);
+}
+
+static struct alloc_stats *
+alloc_stats_or_die (alloc_func zalloc, free_func zfree, voidpf opaque)
+{
+  struct alloc_stats *stats;
+
+  stats = calloc (1, sizeof (*stats));
+  if (!stats)
+    die ("oom");
+  stats->zalloc = zalloc;
+  stats->zfree = zfree;
+  stats->opaque = opaque;
+  return stats;
+}
+
+static void
+free_alloc_stats (struct alloc_stats *stats)
+{
+  struct alloc_entry *entry;
+  struct alloc_entry *tmp;
+
+  if (!stats)
+    return;
+  HASH_ITER (hh, stats->entries, entry, tmp)
+  {
+    HASH_DELETE (hh, stats->entries, entry);
+    free (entry);
+  }
+  free (stats);
+}
+
+/* Route the allocations of a stream that is about to be initialized. */
+static struct alloc_stats *
+wrap_alloc_or_die (z_streamp strm)
+{
+  struct alloc_stats *stats;
+
+  stats = alloc_stats_or_die (strm->zalloc, strm->zfree, strm->opaque);
+  strm->zalloc = alloc_wrapper;
+  strm->zfree = free_wrapper;
+  strm->opaque = stats;
+  return stats;
+}
+
+static void
+unwrap_alloc (z_streamp strm, struct alloc_stats *stats)
+{
+  if (!stats)
+    return;
+  strm->zalloc = stats->zalloc;
+  strm->zfree = stats->zfree;
+  strm->opaque = stats->opaque;
+  free_alloc_stats (stats);
+}
+
+/* Parameters that a stream would be initialized with to get its state. */
+struct stream_params
+{
+  char kind;
+  int level;
+  int method;
+  int window_bits;
+  int mem_level;
+  int strategy;
+};
+
+/* Format an init line that recreates a stream with params. */
+static void
+format_init (char *buf, size_t size, const struct stream_params *params)
+{
+  if (params->kind == 'd')
+    snprintf (buf, size, "d 2 %i %i %i %i %i\n", params->level,
+              params->method, params->window_bits, params->mem_level,
+              params->strategy);
+  else
+    snprintf (buf, size, "i 2 %i\n", params->window_bits);
+}
+
+/*
+ * In flight-recorder mode, trace data stays in per-stream in-memory rings.
+ * Data since the last checkpoint, i.e. since init or reset, is replayable
+ * when it still fits: it is dumped together with an init line that recreates
+ * the stream state at the checkpoint.
+ */
+struct flight_buffer
+{
+  char *data;
+  uint64_t pos;    /* bytes written so far */
+  uint64_t start;  /* pos at the last checkpoint */
+  uint64_t commit; /* pos at the end of the last complete record */
+};
+
+struct flight
+{
+  pthread_mutex_t lock;
+  struct flight_buffer buffers[3]; /* indexed by enum ring_file */
+  struct stream_params checkpoint_params;
+  int has_checkpoint;
+};
+
+/* Index lines are written and synced in batches of up to this many bytes. */
+#define INDEX_BATCH_SIZE 4096
+#define INDEX_LINE_MAX 64
+
+/* Bytes of a payload that do not form a complete chunk yet. */
+struct chunker
+{
+  unsigned char *data;
+  size_t len;
+  size_t size;
+  uint64_t hash; /* rolling hash over data */
+  char index[INDEX_BATCH_SIZE]; /* lines of chunks that are not synced */
+  size_t index_len;
+};
+
 struct hash_entry
 {
   z_streamp strm;
   unsigned long counter;
+  uint64_t moff;
+  struct alloc_stats *alloc;
+  struct stream_params params;
+  struct flight *flight;
+  struct chunker *chunkers; /* indexed by RING_IN and RING_OUT */
+  unsigned long capture;    /* that the open trace belongs to, or 0 */
   int ifd;
   int ofd;
   int mfd;
@@ -78,59 +333,1002 @@ static struct hash_entry *streams;
 static atomic_ulong streams_counter;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static struct hash_entry *
-add_stream_or_die (z_streamp strm, const char *kind)
+/*
+ * Streams that are initialized while recording is off are not tracked: they
+ * keep their allocator, and only their parameters are kept here, so that they
+ * can be picked up later.  Protected by mutex, like streams.
+ */
+struct untracked_entry
+{
+  z_streamp strm;
+  struct stream_params params;
+  UT_hash_handle hh;
+};
+
+static struct untracked_entry *untracked;
+
+/*
+ * Recording can be switched on and off while the process runs.  Each period
+ * of recording is a capture, and the trace of a stream belongs to the capture
+ * in which it was opened.
+ */
+static atomic_int recording = 1;
+static atomic_ulong capture = 1;
+
+/* Monotonic, so that timestamps are comparable across processes. */
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* When set, a capture stops by itself after this long. */
+static uint64_t capture_duration_ns;
+static atomic_uint_least64_t capture_deadline;
+
+/* When set, recording is on while this file exists. */
+static const char *control_file;
+static int watcher_running;
+
+/*
+ * Set in recording by a forked child, whose watcher did not survive the
+ * fork, so that its next call leaves the fast path and restarts it.
+ */
+#define RECORDING_NO_WATCHER 2
+
+/* Async-signal-safe. */
+static void
+set_recording (int on)
+{
+  if (on && !(atomic_load (&recording) & 1))
+    {
+      atomic_fetch_add (&capture, 1);
+      if (capture_duration_ns)
+        atomic_store (&capture_deadline, now_ns () + capture_duration_ns);
+    }
+  atomic_store (&recording, on);
+}
+
+static void
+toggle_signal (int sig)
+{
+  (void)sig;
+  set_recording (!atomic_load (&recording));
+}
+
+/*
+ * Recording follows the appearance and disappearance of the control file,
+ * so a capture that stopped because of ZLIB_RECORD_DURATION stays stopped
+ * until the file is created again.
+ */
+static void *
+watch_control_file (void *arg)
+{
+  struct timespec interval = { 0, 100000000 };
+  int exists;
+  int existed = atomic_load (&recording) & 1;
+
+  (void)arg;
+  for (;;)
+    {
+      exists = access (control_file, F_OK) == 0;
+      if (exists != existed)
+        set_recording (exists);
+      existed = exists;
+      nanosleep (&interval, NULL);
+    }
+  return NULL;
+}
+
+/* Called with mutex held. */
+static void
+start_watcher_or_die (void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  if (pthread_attr_init (&attr) != 0
+      || pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED) != 0
+      || pthread_create (&thread, &attr, watch_control_file, NULL) != 0)
+    die ("could not start the control file watcher");
+  pthread_attr_destroy (&attr);
+  watcher_running = 1;
+}
+
+/* Whether to record now.  Ends the capture when its time is up. */
+static int
+capture_active (void)
+{
+  uint64_t deadline;
+  int on;
+
+  on = atomic_load_explicit (&recording, memory_order_relaxed);
+  if (on & RECORDING_NO_WATCHER)
+    {
+      pthread_mutex_lock (&mutex);
+      if (!watcher_running)
+        {
+          set_recording (access (control_file, F_OK) == 0);
+          start_watcher_or_die ();
+        }
+      pthread_mutex_unlock (&mutex);
+      on = atomic_load (&recording);
+    }
+  if (!on)
+    return 0;
+  deadline = atomic_load_explicit (&capture_deadline, memory_order_relaxed);
+  if (deadline && now_ns () >= deadline)
+    {
+      atomic_store (&recording, 0);
+      return 0;
+    }
+  return 1;
+}
+
+/*
+ * When set, trace data goes to zlib-collector instead of files.  Threads push
+ * records without a lock: each reserves its space by moving ring_reserved,
+ * copies its record in, and publishes it by moving the ring's head once the
+ * records reserved before it have been published.  ring_mutex only guards
+ * connecting.
+ */
+static const char *collector_path;
+static _Atomic (struct ring *) ring;
+static _Atomic uint64_t ring_reserved;
+static int ring_sock = -1;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+ring_connect_or_die (void)
+{
+  struct sockaddr_un addr;
+  struct ring_hello hello;
+  struct iovec iov;
+  struct msghdr msg;
+  union
+  {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  struct cmsghdr *cmsg;
+  const char *size_str;
+  uint64_t size = RING_DEFAULT_SIZE;
+  struct ring *r;
+  char name[64];
+  int fd;
+
+  size_str = getenv ("ZLIB_RECORD_RING_SIZE");
+  if (size_str)
+    size = strtoull (size_str, NULL, 0);
+  if (size < 4096 || (size & (size - 1)) != 0)
+    die ("ZLIB_RECORD_RING_SIZE must be a power of 2 >= 4096");
+  snprintf (name, sizeof (name), "/zlib-record.%lu",
+            (unsigned long)getpid ());
+  shm_unlink (name); /* stale ring from a crashed process, ignore rc */
+  fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    die ("shm_open() failed");
+  if (shm_unlink (name) < 0)
+    die ("shm_unlink() failed");
+  if (ftruncate (fd, sizeof (struct ring) + size) < 0)
+    die ("ftruncate() failed");
+  r = mmap (NULL, sizeof (struct ring) + size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+  if (r == MAP_FAILED)
+    die ("mmap() failed");
+  r->magic = RING_MAGIC;
+  r->size = size;
+  atomic_init (&r->head, 0);
+  atomic_init (&r->tail, 0);
+
+  ring_sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (ring_sock == -1)
+    die ("socket() failed");
+  if (fcntl (ring_sock, F_SETFD, FD_CLOEXEC) < 0)
+    die ("fcntl() failed");
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (collector_path) >= sizeof (addr.sun_path))
+    die ("collector socket path is too long: %s", collector_path);
+  strcpy (addr.sun_path, collector_path);
+  if (connect (ring_sock, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+    die ("could not connect to collector %s", collector_path);
+
+  hello.magic = RING_MAGIC;
+  hello.pid = (uint32_t)getpid ();
+  hello.size = size;
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof (hello);
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+  if (sendmsg (ring_sock, &msg, 0) != sizeof (hello))
+    die ("sendmsg() failed");
+  close_or_die (fd);
+  atomic_store_explicit (&ring_reserved, 0, memory_order_relaxed);
+  atomic_store_explicit (&ring, r, memory_order_release);
+}
+
+static struct ring *
+ring_get_or_die (void)
+{
+  struct ring *r;
+
+  r = atomic_load_explicit (&ring, memory_order_acquire);
+  if (r)
+    return r;
+  pthread_mutex_lock (&ring_mutex);
+  if (!atomic_load_explicit (&ring, memory_order_relaxed))
+    ring_connect_or_die ();
+  r = atomic_load_explicit (&ring, memory_order_relaxed);
+  pthread_mutex_unlock (&ring_mutex);
+  return r;
+}
+
+static void
+ring_wait_or_die (void)
+{
+  struct pollfd pfd;
+
+  pfd.fd = ring_sock;
+  pfd.events = 0;
+  if (poll (&pfd, 1, 1) < 0)
+    die ("poll() failed");
+  if (pfd.revents & (POLLHUP | POLLERR))
+    die ("collector went away");
+}
+
+/* Where the next need bytes go, once the collector has made room for them. */
+static uint64_t
+ring_reserve_or_die (struct ring *r, uint64_t need)
+{
+  uint64_t start;
+
+  start = atomic_load_explicit (&ring_reserved, memory_order_relaxed);
+  for (;;)
+    {
+      if (r->size
+              - (start - atomic_load_explicit (&r->tail, memory_order_acquire))
+          < need)
+        {
+          ring_wait_or_die ();
+          start = atomic_load_explicit (&ring_reserved, memory_order_relaxed);
+        }
+      else if (atomic_compare_exchange_weak_explicit (
+                   &ring_reserved, &start, start + need,
+                   memory_order_relaxed, memory_order_relaxed))
+        return start;
+    }
+}
+
+static void
+ring_push_or_die (uint32_t type, uint32_t file, unsigned long stream,
+                  const void *buf, size_t count)
+{
+  struct ring_record record;
+  struct ring *r;
+  uint64_t start;
+  uint64_t need;
+  size_t n;
+
+  r = ring_get_or_die ();
+  do
+    {
+      n = count < r->size / 4 ? count : r->size / 4;
+      need = sizeof (record) + RING_ALIGN (n);
+      start = ring_reserve_or_die (r, need);
+      record.type = type;
+      record.file = file;
+      record.stream = stream;
+      record.len = n;
+      ring_copy_in (r, start, &record, sizeof (record));
+      ring_copy_in (r, start + sizeof (record), buf, n);
+      /* Acquire, so that the collector sees the earlier records as well. */
+      while (atomic_load_explicit (&r->head, memory_order_acquire) != start)
+        sched_yield ();
+      atomic_store_explicit (&r->head, start + need, memory_order_release);
+      buf = (const char *)buf + n;
+      count -= n;
+    }
+  while (count);
+}
+
+/* When set, trace data is kept in memory and written only on errors. */
+static size_t flight_size;
+static atomic_int flight_dump_requested;
+
+static struct flight *
+flight_new_or_die (void)
+{
+  struct flight *flight;
+  int i;
+
+  flight = calloc (1, sizeof (*flight));
+  if (!flight)
+    die ("oom");
+  pthread_mutex_init (&flight->lock, NULL);
+  for (i = 0; i < 3; i++)
+    if (!(flight->buffers[i].data = malloc (flight_size)))
+      die ("oom");
+  return flight;
+}
+
+static void
+flight_free (struct flight *flight)
+{
+  int i;
+
+  for (i = 0; i < 3; i++)
+    free (flight->buffers[i].data);
+  pthread_mutex_destroy (&flight->lock);
+  free (flight);
+}
+
+static void
+flight_write (struct flight *flight, enum ring_file file, const void *buf,
+              size_t count)
+{
+  struct flight_buffer *b = &flight->buffers[file];
+  size_t off;
+  size_t n;
+
+  pthread_mutex_lock (&flight->lock);
+  if (count > flight_size)
+    {
+      buf = (const char *)buf + (count - flight_size);
+      b->pos += count - flight_size;
+      count = flight_size;
+    }
+  off = b->pos % flight_size;
+  n = count < flight_size - off ? count : flight_size - off;
+  memcpy (b->data + off, buf, n);
+  memcpy (b->data, (const char *)buf + n, count - n);
+  b->pos += count;
+  pthread_mutex_unlock (&flight->lock);
+}
+
+static void
+flight_commit (struct flight *flight)
+{
+  int i;
+
+  pthread_mutex_lock (&flight->lock);
+  for (i = 0; i < 3; i++)
+    flight->buffers[i].commit = flight->buffers[i].pos;
+  pthread_mutex_unlock (&flight->lock);
+}
+
+static void
+flight_checkpoint (struct hash_entry *stream)
+{
+  struct flight *flight = stream->flight;
+  int i;
+
+  pthread_mutex_lock (&flight->lock);
+  for (i = 0; i < 3; i++)
+    flight->buffers[i].start = flight->buffers[i].commit
+        = flight->buffers[i].pos;
+  flight->checkpoint_params = stream->params;
+  flight->has_checkpoint = 1;
+  pthread_mutex_unlock (&flight->lock);
+}
+
+static void
+flight_dump_buffer_or_die (const char *path, const char *prefix,
+                           const struct flight_buffer *b, uint64_t from,
+                           const char *suffix)
+{
+  size_t off;
+  size_t n;
+  int fd;
+
+  fd = creat_or_die (path);
+  if (prefix)
+    write_or_die (fd, prefix, strlen (prefix));
+  if (from + flight_size < b->commit)
+    from = b->commit - flight_size;
+  off = from % flight_size;
+  n = b->commit - from;
+  if (n > flight_size - off)
+    {
+      write_or_die (fd, b->data + off, flight_size - off);
+      n -= flight_size - off;
+      off = 0;
+    }
+  write_or_die (fd, b->data + off, n);
+  if (suffix)
+    write_or_die (fd, suffix, strlen (suffix));
+  close_or_die (fd);
+}
+
+static void
+flight_dump_or_die (struct hash_entry *stream)
+{
+  struct flight *flight = stream->flight;
+  const struct stream_params *params = &flight->checkpoint_params;
+  const char *kind = stream->params.kind == 'd' ? "deflate" : "inflate";
+  const char *suffix = "";
+  char init[128];
+  char path[256];
+  int replayable;
+  int i;
+
+  pthread_mutex_lock (&flight->lock);
+  replayable = flight->has_checkpoint;
+  for (i = 0; i < 3; i++)
+    if (flight->buffers[i].commit - flight->buffers[i].start > flight_size)
+      replayable = 0;
+  if (replayable)
+    format_init (init, sizeof (init), params);
+  else
+    suffix = ".partial";
+  snprintf (path, sizeof (path), "%s.%lu.%lu%s.in", kind,
+            (unsigned long)getpid (), stream->counter, suffix);
+  flight_dump_buffer_or_die (path, NULL, &flight->buffers[RING_IN],
+                             flight->buffers[RING_IN].start, NULL);
+  snprintf (path, sizeof (path), "%s.%lu.%lu%s.out", kind,
+            (unsigned long)getpid (), stream->counter, suffix);
+  flight_dump_buffer_or_die (path, NULL, &flight->buffers[RING_OUT],
+                             flight->buffers[RING_OUT].start, NULL);
+  snprintf (path, sizeof (path), "%s.%lu.%lu%s", kind,
+            (unsigned long)getpid (), stream->counter, suffix);
+  /* The stream goes on after the dump. */
+  flight_dump_buffer_or_die (path, replayable ? init : NULL,
+                             &flight->buffers[RING_META],
+                             flight->buffers[RING_META].start,
+                             replayable ? "x\n" : NULL);
+  pthread_mutex_unlock (&flight->lock);
+  fprintf (stderr, "zlib-record: dumped %s\n", path);
+}
+
+static void
+flight_dump_all_or_die (void)
+{
+  struct hash_entry *p;
+  struct hash_entry *tmp;
+
+  pthread_mutex_lock (&mutex);
+  HASH_ITER (hh, streams, p, tmp)
+  {
+    if (p->flight)
+      flight_dump_or_die (p);
+  }
+  pthread_mutex_unlock (&mutex);
+}
+
+static void
+flight_signal (int sig)
+{
+  (void)sig;
+  atomic_store (&flight_dump_requested, 1);
+}
+
+/* When set, payloads are deduplicated into this chunk store. */
+static const char *dedup_store;
+static int dedup_fd = -1; /* the store directory */
+static uint64_t gear[256];
+static atomic_ulong dedup_tmp_counter;
+
+/* Chunks that this process has already stored. */
+struct known_chunk
+{
+  uint64_t hash;
+  size_t len;
+  UT_hash_handle hh;
+};
+
+static struct known_chunk *known_chunks;
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+dedup_init_or_die (void)
+{
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  int i;
+
+  if (collector_path || flight_size)
+    die ("ZLIB_RECORD_DEDUP cannot be combined with ZLIB_RECORD_COLLECTOR "
+         "or ZLIB_RECORD_FLIGHT");
+  if (strlen (dedup_store) + 64 > PATH_MAX)
+    die ("ZLIB_RECORD_DEDUP is too long");
+  if (mkdir (dedup_store, 0777) < 0 && errno != EEXIST)
+    die ("could not create %s", dedup_store);
+  dedup_fd = open (dedup_store, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dedup_fd == -1)
+    die ("could not open %s", dedup_store);
+  /* splitmix64, so that chunk boundaries are the same in every process. */
+  for (i = 0; i < 256; i++)
+    {
+      x += 0x9e3779b97f4a7c15ULL;
+      gear[i] = chunk_mix (x);
+    }
+}
+
+static int
+is_known_chunk_or_die (uint64_t hash, size_t len)
+{
+  struct known_chunk *k;
+  size_t known_len = 0;
+
+  pthread_mutex_lock (&dedup_mutex);
+  HASH_FIND (hh, known_chunks, &hash, sizeof (hash), k);
+  if (k)
+    known_len = k->len;
+  pthread_mutex_unlock (&dedup_mutex);
+  if (k && known_len != len)
+    die ("chunk hash collision: %016" PRIx64, hash);
+  return k != NULL;
+}
+
+static void
+add_known_chunk_or_die (uint64_t hash, size_t len)
+{
+  struct known_chunk *k;
+  struct known_chunk *found;
+
+  k = malloc (sizeof (*k));
+  if (!k)
+    die ("oom");
+  k->hash = hash;
+  k->len = len;
+  pthread_mutex_lock (&dedup_mutex);
+  HASH_FIND (hh, known_chunks, &hash, sizeof (hash), found);
+  if (found)
+    free (k);
+  else
+    HASH_ADD (hh, known_chunks, hash, sizeof (hash), k);
+  pthread_mutex_unlock (&dedup_mutex);
+}
+
+/*
+ * Whether the chunk at path holds data.  A stored chunk with other contents
+ * and the same hash is a collision; one with a different hash was cut short
+ * by a crash and can be replaced.
+ */
+static int
+is_stored_chunk_or_die (const char *path, uint64_t hash, const void *data,
+                        size_t len)
 {
+  struct stat st;
+  void *stored;
+  int same = 0;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if (errno != ENOENT)
+        die ("could not open %s", path);
+      return 0;
+    }
+  if (fstat (fd, &st) < 0)
+    die ("fstat() failed");
+  if (st.st_size > 0)
+    {
+      stored = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (stored == MAP_FAILED)
+        die ("mmap() failed");
+      same = (size_t)st.st_size == len && memcmp (stored, data, len) == 0;
+      if (!same && chunk_hash (stored, st.st_size) == hash)
+        die ("chunk hash collision: %s", path);
+      munmap (stored, st.st_size);
+    }
+  close_or_die (fd);
+  return same;
+}
+
+/*
+ * Other processes may store the same chunk concurrently, so it is written to
+ * a temporary file and renamed into place.  It is synced along with the
+ * index lines that refer to it.
+ */
+static void
+store_chunk_or_die (uint64_t hash, const void *data, size_t len)
+{
+  char path[PATH_MAX];
+  char tmp[PATH_MAX + 64];
+  int known;
+  int fd;
+
+  known = is_known_chunk_or_die (hash, len);
+  if (!known)
+    {
+      snprintf (path, sizeof (path), "%s/%02x", dedup_store,
+                (unsigned)(hash >> 56));
+      if (mkdir (path, 0777) < 0 && errno != EEXIST)
+        die ("could not create %s", path);
+    }
+  snprintf (path, sizeof (path), "%s/%02x/%016" PRIx64, dedup_store,
+            (unsigned)(hash >> 56), hash);
+  if (!is_stored_chunk_or_die (path, hash, data, len))
+    {
+      snprintf (tmp, sizeof (tmp), "%s.%lu.%lu.tmp", path,
+                (unsigned long)getpid (),
+                atomic_fetch_add (&dedup_tmp_counter, 1));
+      fd = creat_or_die (tmp);
+      write_all_or_die (fd, data, len);
+      close_or_die (fd);
+      if (rename (tmp, path) < 0)
+        die ("rename() failed");
+    }
+  if (!known)
+    add_known_chunk_or_die (hash, len);
+}
+
+/* Make the stored chunks durable, then the index lines that list them. */
+static void
+chunker_sync_or_die (struct chunker *c, int fd)
+{
+  if (!c->index_len)
+    return;
+#ifdef __APPLE__
+  sync ();
+#else
+  if (syncfs (dedup_fd) < 0)
+    die ("syncfs() failed");
+#endif
+  write_or_die (fd, c->index, c->index_len);
+  c->index_len = 0;
+}
+
+static void
+emit_chunk_or_die (struct chunker *c, int fd, const void *data, size_t len)
+{
+  uint64_t hash = chunk_hash (data, len);
+
+  store_chunk_or_die (hash, data, len);
+  if (c->index_len + INDEX_LINE_MAX > sizeof (c->index))
+    chunker_sync_or_die (c, fd);
+  c->index_len += snprintf (c->index + c->index_len, INDEX_LINE_MAX,
+                            "%016" PRIx64 " %zu\n", hash, len);
+}
+
+static void
+chunker_append_or_die (struct chunker *c, const unsigned char *buf,
+                       size_t count)
+{
+  size_t size;
+
+  if (c->len + count > c->size)
+    {
+      size = c->size ? c->size : 4096;
+      while (size < c->len + count)
+        size *= 2;
+      c->data = realloc (c->data, size);
+      if (!c->data)
+        die ("oom");
+      c->size = size;
+    }
+  memcpy (c->data + c->len, buf, count);
+  c->len += count;
+}
+
+/*
+ * Cut at the positions where a gear hash of the preceding bytes matches
+ * CHUNK_MASK, so that boundaries move along with inserted or removed data.
+ * Chunks that end within buf are stored straight from it.
+ */
+static void
+chunker_write_or_die (struct chunker *c, int fd, const unsigned char *buf,
+                      size_t count)
+{
+  size_t start = 0;
+  size_t n = c->len;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      c->hash = (c->hash << 1) + gear[buf[i]];
+      n++;
+      if (n < CHUNK_MIN_SIZE
+          || ((c->hash & CHUNK_MASK) != 0 && n < CHUNK_MAX_SIZE))
+        continue;
+      if (c->len)
+        {
+          chunker_append_or_die (c, buf + start, i + 1 - start);
+          emit_chunk_or_die (c, fd, c->data, c->len);
+          c->len = 0;
+        }
+      else
+        emit_chunk_or_die (c, fd, buf + start, i + 1 - start);
+      start = i + 1;
+      n = 0;
+      c->hash = 0;
+    }
+  chunker_append_or_die (c, buf + start, count - start);
+}
+
+static void
+chunker_flush_or_die (struct chunker *c, int fd)
+{
+  if (c->len)
+    emit_chunk_or_die (c, fd, c->data, c->len);
+  chunker_sync_or_die (c, fd);
+  c->len = 0;
+  c->hash = 0;
+}
+
+static void
+write_index_header_or_die (int fd)
+{
+  write_all_or_die (fd, "s ", 2);
+  write_all_or_die (fd, dedup_store, strlen (dedup_store));
+  write_or_die (fd, "\n", 1);
+}
+
+static void
+stream_write_or_die (struct hash_entry *stream, enum ring_file file,
+                     const void *buf, size_t count)
+{
+  if (file == RING_META)
+    stream->moff += count;
+  if (flight_size)
+    {
+      flight_write (stream->flight, file, buf, count);
+      return;
+    }
+  if (collector_path)
+    {
+      if (count)
+        ring_push_or_die (RING_DATA, file, stream->counter, buf, count);
+      return;
+    }
+  if (dedup_store && file != RING_META)
+    {
+      chunker_write_or_die (&stream->chunkers[file],
+                            file == RING_IN ? stream->ifd : stream->ofd, buf,
+                            count);
+      return;
+    }
+  switch (file)
+    {
+    case RING_IN:
+      write_or_die (stream->ifd, buf, count);
+      break;
+    case RING_OUT:
+      write_or_die (stream->ofd, buf, count);
+      break;
+    case RING_META:
+      write_or_die (stream->mfd, buf, count);
+      break;
+    }
+}
+
+/*
+ * Release what the stream's trace holds in this process.  The stream may
+ * still be in streams, where flight_dump_all_or_die () looks at its flight
+ * rings, so these are detached under mutex.
+ */
+static void
+discard_trace_or_die (struct hash_entry *p)
+{
+  struct flight *flight;
+
+  if (!p->capture)
+    return;
+  if (flight_size)
+    {
+      pthread_mutex_lock (&mutex);
+      flight = p->flight;
+      p->flight = NULL;
+      pthread_mutex_unlock (&mutex);
+      flight_free (flight);
+    }
+  else if (!collector_path)
+    {
+      close_or_die (p->ifd);
+      close_or_die (p->ofd);
+      close_or_die (p->mfd);
+    }
+  if (p->chunkers)
+    {
+      free (p->chunkers[RING_IN].data);
+      free (p->chunkers[RING_OUT].data);
+      free (p->chunkers);
+    }
+  p->chunkers = NULL;
+  p->capture = 0;
+}
+
+/*
+ * Whether the stream's trace may have missed calls, because the capture that
+ * it belongs to is over.
+ */
+static int
+trace_is_cut (const struct hash_entry *p)
+{
+  uint64_t deadline = atomic_load (&capture_deadline);
+
+  return p->capture != atomic_load (&capture)
+         || !(atomic_load (&recording) & 1)
+         || (deadline && now_ns () >= deadline);
+}
+
+/* Mark a trace that ends before its stream, which replay has to allow for. */
+static void
+write_cut_or_die (struct hash_entry *p)
+{
+  stream_write_or_die (p, RING_META, "x\n", 2);
+}
+
+static void
+close_trace_or_die (struct hash_entry *p)
+{
+  if (!p->capture)
+    return;
+  if (trace_is_cut (p))
+    write_cut_or_die (p);
+  if (collector_path && !flight_size)
+    ring_push_or_die (RING_CLOSE, 0, p->counter, NULL, 0);
+  if (p->chunkers)
+    {
+      chunker_flush_or_die (&p->chunkers[RING_IN], p->ifd);
+      chunker_flush_or_die (&p->chunkers[RING_OUT], p->ofd);
+    }
+  discard_trace_or_die (p);
+}
+
+/* Start a trace of the stream in the current capture. */
+static void
+open_trace_or_die (struct hash_entry *p)
+{
+  const char *kind = p->params.kind == 'd' ? "deflate" : "inflate";
+  struct flight *flight;
+  const char *suffix;
   unsigned long pid;
   char path[256];
+
+  pid = (unsigned long)getpid ();
+  p->counter = atomic_fetch_add (&streams_counter, 1);
+  p->moff = 0;
+  p->capture = atomic_load (&capture);
+  if (flight_size)
+    {
+      flight = flight_new_or_die ();
+      pthread_mutex_lock (&mutex);
+      p->flight = flight;
+      pthread_mutex_unlock (&mutex);
+    }
+  else if (collector_path)
+    {
+      snprintf (path, sizeof (path), "%s.%lu.%lu", kind, pid, p->counter);
+      ring_push_or_die (RING_OPEN, 0, p->counter, path, strlen (path));
+    }
+  else
+    {
+      suffix = dedup_store ? CHUNK_SUFFIX : "";
+      snprintf (path, sizeof (path), "%s.%lu.%lu.in%s", kind, pid, p->counter,
+                suffix);
+      p->ifd = creat_or_die (path);
+      snprintf (path, sizeof (path), "%s.%lu.%lu.out%s", kind, pid,
+                p->counter, suffix);
+      p->ofd = creat_or_die (path);
+      if (dedup_store)
+        {
+          p->chunkers = calloc (2, sizeof (*p->chunkers));
+          if (!p->chunkers)
+            die ("oom");
+          write_index_header_or_die (p->ifd);
+          write_index_header_or_die (p->ofd);
+        }
+      snprintf (path, sizeof (path), "%s.%lu.%lu", kind, pid, p->counter);
+      p->mfd = creat_or_die (path);
+    }
+}
+
+/*
+ * Streams that are initialized while recording is on are tracked whether or
+ * not they are being recorded later, so that they can be picked up again.
+ */
+static struct hash_entry *
+add_stream_or_die (z_streamp strm, struct alloc_stats *alloc,
+                   const struct stream_params *params)
+{
+  struct untracked_entry *u;
   struct hash_entry *p;
 
   p = calloc (1, sizeof (*p));
   if (!p)
     die ("oom");
   p->strm = strm;
-  pid = (unsigned long)getpid ();
-  p->counter = atomic_fetch_add (&streams_counter, 1);
-  snprintf (path, sizeof (path), "%s.%lu.%lu.in", kind, pid, p->counter);
-  p->ifd = creat_or_die (path);
-  snprintf (path, sizeof (path), "%s.%lu.%lu.out", kind, pid, p->counter);
-  p->ofd = creat_or_die (path);
-  snprintf (path, sizeof (path), "%s.%lu.%lu", kind, pid, p->counter);
-  p->mfd = creat_or_die (path);
+  p->alloc = alloc;
+  p->params = *params;
   pthread_mutex_lock (&mutex);
+  HASH_FIND (hh, untracked, &strm, sizeof (z_streamp), u);
+  if (u)
+    HASH_DELETE (hh, untracked, u);
   HASH_ADD (hh, streams, strm, sizeof (z_streamp), p);
   pthread_mutex_unlock (&mutex);
+  free (u);
   return p;
 }
 
+static int
+untrack_stream_or_die (z_streamp strm, const struct stream_params *params,
+                       int err)
+{
+  struct untracked_entry *u;
+
+  if (err != Z_OK)
+    return err;
+  pthread_mutex_lock (&mutex);
+  HASH_FIND (hh, untracked, &strm, sizeof (z_streamp), u);
+  if (!u)
+    {
+      u = malloc (sizeof (*u));
+      if (!u)
+        die ("oom");
+      u->strm = strm;
+      HASH_ADD (hh, untracked, strm, sizeof (z_streamp), u);
+    }
+  u->params = *params;
+  pthread_mutex_unlock (&mutex);
+  return err;
+}
+
+/*
+ * The tracked stream strm, or NULL if it is untracked, in which case params
+ * gets its parameters.
+ */
 static struct hash_entry *
-find_stream_or_die (z_streamp strm)
+find_any_stream_or_die (z_streamp strm, struct stream_params *params)
 {
+  struct untracked_entry *u = NULL;
   struct hash_entry *p;
 
   pthread_mutex_lock (&mutex);
   HASH_FIND (hh, streams, &strm, sizeof (z_streamp), p);
-  pthread_mutex_unlock (&mutex);
   if (!p)
+    {
+      HASH_FIND (hh, untracked, &strm, sizeof (z_streamp), u);
+      if (u)
+        *params = u->params;
+    }
+  pthread_mutex_unlock (&mutex);
+  if (!p && !u)
     die ("unknown stream: %p", (void *)strm);
   return p;
 }
 
-static void
+static struct alloc_stats *
 end_stream_or_die (z_streamp strm, const char *kind)
 {
+  struct untracked_entry *u = NULL;
+  struct alloc_stats *alloc;
   struct hash_entry *p;
 
   pthread_mutex_lock (&mutex);
   HASH_FIND (hh, streams, &strm, sizeof (z_streamp), p);
   if (p)
     HASH_DELETE (hh, streams, p);
+  else
+    {
+      HASH_FIND (hh, untracked, &strm, sizeof (z_streamp), u);
+      if (u)
+        HASH_DELETE (hh, untracked, u);
+    }
   pthread_mutex_unlock (&mutex);
+  if (u)
+    {
+      free (u);
+      return NULL;
+    }
   if (!p)
     die ("unknown %s stream: %p", kind, (void *)strm);
-  close_or_die (p->ifd);
-  close_or_die (p->ofd);
+  close_trace_or_die (p);
+  alloc = p->alloc;
   free (p);
+  return alloc;
 }
 
 __attribute__ ((format (printf, 2, 3))) static void
@@ -142,26 +1340,233 @@ printf_stream_or_die (struct hash_entry *stream, const char *fmt, ...)
 
   va_start (args, fmt);
   n = vsnprintf (line, sizeof (line), fmt, args);
-  write_or_die (stream->mfd, line, n);
+  stream_write_or_die (stream, RING_META, line, n);
   va_end (args);
 }
 
+/* Follow a deflateParams () on strm, whether or not it is tracked. */
+static void
+set_params_or_die (z_streamp strm, int level, int strategy)
+{
+  struct stream_params *params = NULL;
+  struct untracked_entry *u;
+  struct hash_entry *p;
+
+  pthread_mutex_lock (&mutex);
+  HASH_FIND (hh, streams, &strm, sizeof (z_streamp), p);
+  if (p)
+    params = &p->params;
+  else
+    {
+      HASH_FIND (hh, untracked, &strm, sizeof (z_streamp), u);
+      if (u)
+        params = &u->params;
+    }
+  if (params)
+    {
+      params->level = level;
+      params->strategy = strategy;
+    }
+  pthread_mutex_unlock (&mutex);
+  if (!params)
+    die ("unknown stream: %p", (void *)strm);
+}
+
+/* Streams that were picked up after their init have no allocation data. */
 static void
-copy_stream_or_die (z_streamp dest, z_streamp source, const char *kind)
+printf_alloc_or_die (struct hash_entry *stream)
+{
+  if (!stream->alloc)
+    return;
+  printf_stream_or_die (stream, "m %lu %lu %lu\n", stream->alloc->allocs,
+                        stream->alloc->bytes, stream->alloc->peak);
+}
+
+static void
+copy_stream_or_die (z_streamp dest, struct hash_entry *source_stream,
+                    struct alloc_stats *alloc, const char *kind)
 {
   struct hash_entry *dest_stream;
-  struct hash_entry *source_stream;
   unsigned long pid;
-  unsigned long off;
 
-  source_stream = find_stream_or_die (source);
-  dest_stream = add_stream_or_die (dest, kind);
+  if (alloc)
+    dest->opaque = alloc;
+  dest_stream = add_stream_or_die (dest, alloc, &source_stream->params);
+  /* A copy is replayable only from the source's trace. */
+  if (!capture_active () || source_stream->capture != atomic_load (&capture))
+    return;
+  open_trace_or_die (dest_stream);
   pid = (unsigned long)getpid ();
-  off = (unsigned long)lseek (source_stream->mfd, 0, SEEK_CUR);
-  if (off == -1UL)
-    die ("lseek() failed");
-  printf_stream_or_die (dest_stream, "%c c %s.%lu.%lu %lu\n", kind[0], kind,
-                        pid, source_stream->counter, off);
+  /*
+   * A flight dump of the source starts at its checkpoint, if it is dumped at
+   * all, so there is no offset to refer to: the copy's dumps stay partial
+   * until it is reset, and only name the source.
+   */
+  if (flight_size)
+    printf_stream_or_die (dest_stream, "%c c %s.%lu.%lu\n", kind[0], kind,
+                          pid, source_stream->counter);
+  else
+    printf_stream_or_die (dest_stream, "%c c %s.%lu.%lu %" PRIu64 "\n",
+                          kind[0], kind, pid, source_stream->counter,
+                          source_stream->moff);
+  printf_alloc_or_die (dest_stream);
+  if (flight_size)
+    flight_commit (dest_stream->flight);
+}
+
+static struct alloc_stats *
+copy_alloc_or_die (struct hash_entry *source_stream)
+{
+  struct alloc_stats *source_alloc = source_stream->alloc;
+
+  if (!source_alloc)
+    return NULL;
+  alloc_redirect = alloc_stats_or_die (
+      source_alloc->zalloc, source_alloc->zfree, source_alloc->opaque);
+  return alloc_redirect;
+}
+
+/* Cached, since it is written with every call. */
+static _Thread_local uint64_t cached_tid;
+
+static void
+fork_prepare (void)
+{
+  pthread_mutex_lock (&mutex);
+  pthread_mutex_lock (&ring_mutex);
+  pthread_mutex_lock (&dedup_mutex);
+}
+
+static void
+fork_parent (void)
+{
+  pthread_mutex_unlock (&dedup_mutex);
+  pthread_mutex_unlock (&ring_mutex);
+  pthread_mutex_unlock (&mutex);
+}
+
+/*
+ * The child is a new process with its own trace names, so it starts with a
+ * clean slate: the parent's traces, files and ring stay with the parent.
+ * Streams that the child inherits can be picked up like the ones that were
+ * open when recording started.  The child registers its own ring on its
+ * first trace.
+ */
+static void
+fork_child (void)
+{
+  struct hash_entry *p;
+  struct hash_entry *tmp;
+  struct ring *r;
+
+  /* The child has only this thread, and discarding a trace takes mutex. */
+  pthread_mutex_unlock (&dedup_mutex);
+  pthread_mutex_unlock (&ring_mutex);
+  pthread_mutex_unlock (&mutex);
+  HASH_ITER (hh, streams, p, tmp)
+  {
+    discard_trace_or_die (p);
+  }
+  atomic_store (&streams_counter, 0);
+  cached_tid = 0;
+  watcher_running = 0;
+  if (control_file)
+    atomic_fetch_or (&recording, RECORDING_NO_WATCHER);
+  r = atomic_load (&ring);
+  if (r)
+    {
+      munmap (r, sizeof (struct ring) + r->size);
+      atomic_store (&ring, NULL);
+      close_or_die (ring_sock);
+      ring_sock = -1;
+    }
+}
+
+__attribute__ ((constructor)) static void
+init_common ()
+{
+  struct sigaction sa;
+  const char *flight_kib;
+  const char *control;
+  const char *paused;
+  const char *duration;
+  double seconds;
+  char *end;
+
+  collector_path = getenv ("ZLIB_RECORD_COLLECTOR");
+  flight_kib = getenv ("ZLIB_RECORD_FLIGHT");
+  if (flight_kib)
+    {
+      flight_size = strtoul (flight_kib, NULL, 0) * 1024;
+      if (flight_size == 0)
+        die ("ZLIB_RECORD_FLIGHT must be a positive number of KiB");
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = flight_signal;
+      sa.sa_flags = SA_RESTART;
+      if (sigaction (SIGUSR2, &sa, NULL) < 0)
+        die ("sigaction() failed");
+    }
+  dedup_store = getenv ("ZLIB_RECORD_DEDUP");
+  if (dedup_store)
+    dedup_init_or_die ();
+  control = getenv ("ZLIB_RECORD_CONTROL");
+  if (control && strcmp (control, "signal") == 0)
+    {
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = toggle_signal;
+      sa.sa_flags = SA_RESTART;
+      if (sigaction (SIGUSR1, &sa, NULL) < 0)
+        die ("sigaction() failed");
+      paused = getenv ("ZLIB_RECORD_PAUSED");
+      if (paused && strcmp (paused, "0") != 0)
+        atomic_store (&recording, 0);
+    }
+  else if (control)
+    {
+      control_file = control;
+      atomic_store (&recording, access (control_file, F_OK) == 0);
+      pthread_mutex_lock (&mutex);
+      start_watcher_or_die ();
+      pthread_mutex_unlock (&mutex);
+    }
+  duration = getenv ("ZLIB_RECORD_DURATION");
+  if (duration)
+    {
+      seconds = strtod (duration, &end);
+      if (end == duration || *end || seconds <= 0)
+        die ("ZLIB_RECORD_DURATION must be a positive number of seconds");
+      capture_duration_ns = (uint64_t)(seconds * 1e9);
+      atomic_store (&capture_deadline, now_ns () + capture_duration_ns);
+    }
+  if (pthread_atfork (fork_prepare, fork_parent, fork_child) != 0)
+    die ("pthread_atfork() failed");
+}
+
+/*
+ * Streams that the process never ended may have traces of a capture that is
+ * over, which are marked, and last chunks pending, which are stored, so that
+ * the trace is complete up to the exit.
+ */
+__attribute__ ((destructor)) static void
+fini_common ()
+{
+  struct hash_entry *p;
+  struct hash_entry *tmp;
+
+  if (flight_size)
+    return;
+  pthread_mutex_lock (&mutex);
+  HASH_ITER (hh, streams, p, tmp)
+  {
+    if (p->capture && trace_is_cut (p))
+      write_cut_or_die (p);
+    if (p->chunkers)
+      {
+        chunker_flush_or_die (&p->chunkers[RING_IN], p->ifd);
+        chunker_flush_or_die (&p->chunkers[RING_OUT], p->ofd);
+      }
+  }
+  pthread_mutex_unlock (&mutex);
 }
 
 #ifndef __APPLE__
@@ -215,34 +1620,111 @@ init ()
 struct call
 {
   struct hash_entry *stream;
+  unsigned long allocs;
   z_const Bytef *next_in;
   Bytef *next_out;
+  uint64_t start_ns;
 };
 
+/* System-wide thread id, so that threads of different processes differ. */
+static uint64_t
+thread_id (void)
+{
+  if (cached_tid == 0)
+    {
+#ifdef __APPLE__
+      pthread_threadid_np (NULL, &cached_tid);
+#else
+      cached_tid = (uint64_t)syscall (SYS_gettid);
+#endif
+    }
+  return cached_tid;
+}
+
 static void
 before_call (struct call *call)
 {
   z_streamp strm = call->stream->strm;
 
+  if (flight_size && atomic_exchange (&flight_dump_requested, 0))
+    flight_dump_all_or_die ();
   printf_stream_or_die (call->stream, "0x%" PRIxPTR " %u 0x%" PRIxPTR " %u\n",
                         (uintptr_t)strm->next_in, strm->avail_in,
                         (uintptr_t)strm->next_out, strm->avail_out);
   call->next_in = strm->next_in;
   call->next_out = strm->next_out;
+  call->allocs = call->stream->alloc ? call->stream->alloc->allocs : 0;
+  call->start_ns = now_ns ();
 }
 
 static void
 after_call (struct call *call, int err)
 {
+  uint64_t end_ns = now_ns ();
   uInt consumed_in;
   uInt consumed_out;
 
   consumed_in = call->stream->strm->next_in - call->next_in;
-  write_or_die (call->stream->ifd, call->next_in, consumed_in);
+  stream_write_or_die (call->stream, RING_IN, call->next_in, consumed_in);
   consumed_out = call->stream->strm->next_out - call->next_out;
-  write_or_die (call->stream->ofd, call->next_out, consumed_out);
+  stream_write_or_die (call->stream, RING_OUT, call->next_out, consumed_out);
   printf_stream_or_die (call->stream, "%u %u %i\n", consumed_in, consumed_out,
                         err);
+  printf_stream_or_die (call->stream, "t %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                        thread_id (), call->start_ns,
+                        end_ns - call->start_ns);
+  if (call->stream->alloc && call->stream->alloc->allocs != call->allocs)
+    printf_alloc_or_die (call->stream);
+  if (flight_size)
+    {
+      flight_commit (call->stream->flight);
+      if (err < 0 && err != Z_BUF_ERROR)
+        flight_dump_or_die (call->stream);
+    }
+}
+
+/* Follow the init line of a new stream. */
+static void
+init_stream_or_die (struct hash_entry *stream)
+{
+  printf_alloc_or_die (stream);
+  if (flight_size)
+    flight_checkpoint (stream);
+}
+
+/*
+ * The stream of a call that is to be recorded, or NULL.  A stream without a
+ * trace in the current capture gets one when it is fresh, i.e. when it has
+ * not processed data since init or reset.  Until then, its state cannot be
+ * recreated, and its calls go through unrecorded.  Untracked streams start
+ * being tracked at that point.
+ */
+static struct hash_entry *
+recorded_stream_or_die (z_streamp strm)
+{
+  struct stream_params params;
+  struct hash_entry *stream;
+  char init[128];
+
+  if (!capture_active ())
+    return NULL;
+  stream = find_any_stream_or_die (strm, &params);
+  if (!stream)
+    {
+      if (strm->total_in != 0 || strm->total_out != 0)
+        return NULL;
+      stream = add_stream_or_die (strm, NULL, &params);
+    }
+  if (stream->capture == atomic_load (&capture))
+    return stream;
+  close_trace_or_die (stream);
+  if (strm->total_in != 0 || strm->total_out != 0)
+    return NULL;
+  open_trace_or_die (stream);
+  format_init (init, sizeof (init), &stream->params);
+  printf_stream_or_die (stream, "%s", init);
+  init_stream_or_die (stream);
+  return stream;
 }
 
 static _Thread_local int depth;
@@ -251,15 +1733,39 @@ extern int REPLACEMENT (deflateInit_) (z_streamp strm, int level,
                                        const char *version, int stream_size)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
+  struct stream_params params;
   struct hash_entry *stream;
 
+  params.kind = 'd';
+  params.level = level;
+  params.method = Z_DEFLATED;
+  params.window_bits = MAX_WBITS;
+  params.mem_level = 8;
+  params.strategy = Z_DEFAULT_STRATEGY;
+  if (depth == 0 && !capture_active ())
+    {
+      depth++;
+      err = ORIG (deflateInit_) (strm, level, version, stream_size);
+      depth--;
+      return untrack_stream_or_die (strm, &params, err);
+    }
+  if (depth == 0)
+    alloc = wrap_alloc_or_die (strm);
   depth++;
   err = ORIG (deflateInit_) (strm, level, version, stream_size);
   depth--;
-  if (depth == 0 && err == Z_OK)
+  if (depth == 0 && err != Z_OK)
+    unwrap_alloc (strm, alloc);
+  else if (depth == 0)
     {
-      stream = add_stream_or_die (strm, "deflate");
-      printf_stream_or_die (stream, "d 1 %i\n", level);
+      stream = add_stream_or_die (strm, alloc, &params);
+      if (capture_active ())
+        {
+          open_trace_or_die (stream);
+          printf_stream_or_die (stream, "d 1 %i\n", level);
+          init_stream_or_die (stream);
+        }
     }
   return err;
 }
@@ -270,17 +1776,42 @@ extern int REPLACEMENT (deflateInit2_) (z_streamp strm, int level, int method,
                                         int stream_size)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
+  struct stream_params params;
   struct hash_entry *stream;
 
+  params.kind = 'd';
+  params.level = level;
+  params.method = method;
+  params.window_bits = window_bits;
+  params.mem_level = mem_level;
+  params.strategy = strategy;
+  if (depth == 0 && !capture_active ())
+    {
+      depth++;
+      err = ORIG (deflateInit2_) (strm, level, method, window_bits,
+                                  mem_level, strategy, version, stream_size);
+      depth--;
+      return untrack_stream_or_die (strm, &params, err);
+    }
+  if (depth == 0)
+    alloc = wrap_alloc_or_die (strm);
   depth++;
   err = ORIG (deflateInit2_) (strm, level, method, window_bits, mem_level,
                               strategy, version, stream_size);
   depth--;
-  if (depth == 0 && err == Z_OK)
+  if (depth == 0 && err != Z_OK)
+    unwrap_alloc (strm, alloc);
+  else if (depth == 0)
     {
-      stream = add_stream_or_die (strm, "deflate");
-      printf_stream_or_die (stream, "d 2 %i %i %i %i %i\n", level, method,
-                            window_bits, mem_level, strategy);
+      stream = add_stream_or_die (strm, alloc, &params);
+      if (capture_active ())
+        {
+          open_trace_or_die (stream);
+          printf_stream_or_die (stream, "d 2 %i %i %i %i %i\n", level,
+                                method, window_bits, mem_level, strategy);
+          init_stream_or_die (stream);
+        }
     }
   return err;
 }
@@ -288,12 +1819,29 @@ extern int REPLACEMENT (deflateInit2_) (z_streamp strm, int level, int method,
 extern int REPLACEMENT (deflateCopy) (z_streamp dest, z_streamp source)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
+  struct stream_params params;
+  struct hash_entry *source_stream = NULL;
+  int top = depth == 0;
 
+  if (top)
+    source_stream = find_any_stream_or_die (source, &params);
+  if (source_stream)
+    alloc = copy_alloc_or_die (source_stream);
   depth++;
   err = ORIG (deflateCopy) (dest, source);
   depth--;
-  if (depth == 0 && err == Z_OK)
-    copy_stream_or_die (dest, source, "deflate");
+  /* The copy of an untracked stream is untracked as well. */
+  if (top && !source_stream)
+    return untrack_stream_or_die (dest, &params, err);
+  if (source_stream)
+    {
+      alloc_redirect = NULL;
+      if (err == Z_OK)
+        copy_stream_or_die (dest, source_stream, alloc, "deflate");
+      else
+        free_alloc_stats (alloc);
+    }
   return err;
 }
 
@@ -303,16 +1851,19 @@ extern int REPLACEMENT (deflateParams) (z_streamp strm, int level,
   struct call call;
   int err;
 
-  if (depth == 0)
+  /* Not a hot call: the parameters are tracked even while not recording. */
+  call.stream = depth == 0 ? recorded_stream_or_die (strm) : NULL;
+  if (call.stream)
     {
-      call.stream = find_stream_or_die (strm);
       printf_stream_or_die (call.stream, "p %i %i\n", level, strategy);
       before_call (&call);
     }
   depth++;
   err = ORIG (deflateParams) (strm, level, strategy);
   depth--;
-  if (depth == 0)
+  if (depth == 0 && err == Z_OK)
+    set_params_or_die (strm, level, strategy);
+  if (call.stream)
     after_call (&call, err);
   return err;
 }
@@ -322,9 +1873,13 @@ extern int REPLACEMENT (deflate) (z_streamp strm, int flush)
   struct call call;
   int err;
 
+  if (!atomic_load_explicit (&recording, memory_order_relaxed))
+    return ORIG (deflate) (strm, flush);
   if (depth == 0)
     {
-      call.stream = find_stream_or_die (strm);
+      call.stream = recorded_stream_or_die (strm);
+      if (!call.stream)
+        return ORIG (deflate) (strm, flush);
       printf_stream_or_die (call.stream, "c %i\n", flush);
       before_call (&call);
     }
@@ -342,9 +1897,13 @@ reset_common (z_streamp strm, int (*orig) (z_streamp))
   struct call call;
   int err;
 
+  if (!atomic_load_explicit (&recording, memory_order_relaxed))
+    return orig (strm);
   if (depth == 0)
     {
-      call.stream = find_stream_or_die (strm);
+      call.stream = recorded_stream_or_die (strm);
+      if (!call.stream)
+        return orig (strm);
       printf_stream_or_die (call.stream, "r\n");
       before_call (&call);
     }
@@ -353,6 +1912,8 @@ reset_common (z_streamp strm, int (*orig) (z_streamp))
   depth--;
   if (depth == 0)
     after_call (&call, err);
+  if (depth == 0 && flight_size && err == Z_OK)
+    flight_checkpoint (call.stream);
   return err;
 }
 
@@ -364,12 +1925,15 @@ extern int REPLACEMENT (deflateReset) (z_streamp strm)
 extern int REPLACEMENT (deflateEnd) (z_streamp strm)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
 
   if (depth == 0)
-    end_stream_or_die (strm, "deflate");
+    alloc = end_stream_or_die (strm, "deflate");
   depth++;
   err = ORIG (deflateEnd) (strm);
   depth--;
+  if (depth == 0)
+    unwrap_alloc (strm, alloc);
   return err;
 }
 
@@ -377,15 +1941,36 @@ extern int REPLACEMENT (inflateInit_) (z_streamp strm, const char *version,
                                        int stream_size)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
+  struct stream_params params;
   struct hash_entry *stream;
 
+  memset (&params, 0, sizeof (params));
+  params.kind = 'i';
+  params.window_bits = MAX_WBITS;
+  if (depth == 0 && !capture_active ())
+    {
+      depth++;
+      err = ORIG (inflateInit_) (strm, version, stream_size);
+      depth--;
+      return untrack_stream_or_die (strm, &params, err);
+    }
+  if (depth == 0)
+    alloc = wrap_alloc_or_die (strm);
   depth++;
   err = ORIG (inflateInit_) (strm, version, stream_size);
   depth--;
-  if (depth == 0 && err == Z_OK)
+  if (depth == 0 && err != Z_OK)
+    unwrap_alloc (strm, alloc);
+  else if (depth == 0)
     {
-      stream = add_stream_or_die (strm, "inflate");
-      printf_stream_or_die (stream, "i 1\n");
+      stream = add_stream_or_die (strm, alloc, &params);
+      if (capture_active ())
+        {
+          open_trace_or_die (stream);
+          printf_stream_or_die (stream, "i 1\n");
+          init_stream_or_die (stream);
+        }
     }
   return err;
 }
@@ -394,15 +1979,36 @@ extern int REPLACEMENT (inflateInit2_) (z_streamp strm, int window_bits,
                                         const char *version, int stream_size)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
+  struct stream_params params;
   struct hash_entry *stream;
 
+  memset (&params, 0, sizeof (params));
+  params.kind = 'i';
+  params.window_bits = window_bits;
+  if (depth == 0 && !capture_active ())
+    {
+      depth++;
+      err = ORIG (inflateInit2_) (strm, window_bits, version, stream_size);
+      depth--;
+      return untrack_stream_or_die (strm, &params, err);
+    }
+  if (depth == 0)
+    alloc = wrap_alloc_or_die (strm);
   depth++;
   err = ORIG (inflateInit2_) (strm, window_bits, version, stream_size);
   depth--;
-  if (depth == 0 && err == Z_OK)
+  if (depth == 0 && err != Z_OK)
+    unwrap_alloc (strm, alloc);
+  else if (depth == 0)
     {
-      stream = add_stream_or_die (strm, "inflate");
-      printf_stream_or_die (stream, "i 2 %i\n", window_bits);
+      stream = add_stream_or_die (strm, alloc, &params);
+      if (capture_active ())
+        {
+          open_trace_or_die (stream);
+          printf_stream_or_die (stream, "i 2 %i\n", window_bits);
+          init_stream_or_die (stream);
+        }
     }
   return err;
 }
@@ -410,12 +2016,29 @@ extern int REPLACEMENT (inflateInit2_) (z_streamp strm, int window_bits,
 extern int REPLACEMENT (inflateCopy) (z_streamp dest, z_streamp source)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
+  struct stream_params params;
+  struct hash_entry *source_stream = NULL;
+  int top = depth == 0;
 
+  if (top)
+    source_stream = find_any_stream_or_die (source, &params);
+  if (source_stream)
+    alloc = copy_alloc_or_die (source_stream);
   depth++;
   err = ORIG (inflateCopy) (dest, source);
   depth--;
-  if (depth == 0 && err == Z_OK)
-    copy_stream_or_die (dest, source, "inflate");
+  /* The copy of an untracked stream is untracked as well. */
+  if (top && !source_stream)
+    return untrack_stream_or_die (dest, &params, err);
+  if (source_stream)
+    {
+      alloc_redirect = NULL;
+      if (err == Z_OK)
+        copy_stream_or_die (dest, source_stream, alloc, "inflate");
+      else
+        free_alloc_stats (alloc);
+    }
   return err;
 }
 
@@ -424,9 +2047,13 @@ extern int REPLACEMENT (inflate) (z_streamp strm, int flush)
   struct call call;
   int err;
 
+  if (!atomic_load_explicit (&recording, memory_order_relaxed))
+    return ORIG (inflate) (strm, flush);
   if (depth == 0)
     {
-      call.stream = find_stream_or_die (strm);
+      call.stream = recorded_stream_or_die (strm);
+      if (!call.stream)
+        return ORIG (inflate) (strm, flush);
       printf_stream_or_die (call.stream, "c %i\n", flush);
       before_call (&call);
     }
@@ -446,12 +2073,15 @@ extern int REPLACEMENT (inflateReset) (z_streamp strm)
 extern int REPLACEMENT (inflateEnd) (z_streamp strm)
 {
   int err;
+  struct alloc_stats *alloc = NULL;
 
   if (depth == 0)
-    end_stream_or_die (strm, "inflate");
+    alloc = end_stream_or_die (strm, "inflate");
   depth++;
   err = ORIG (inflateEnd) (strm);
   depth--;
+  if (depth == 0)
+    unwrap_alloc (strm, alloc);
   return err;
 }
 
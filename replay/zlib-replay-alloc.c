@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "zlib-replay-alloc.h"
+
+/*
+ * Allocations are prefixed with a header, so that frees know the size of
+ * the block and which free list it belongs to.
+ */
+struct mem_header
+{
+  size_t size;
+  int bucket;
+};
+
+#define MEM_HEADER 16
+#define MEM_BUCKETS 32
+#define HUGEPAGE_SIZE (2UL << 20)
+
+struct mem_block
+{
+  struct mem_block *next;
+};
+
+struct mem_bucket
+{
+  size_t size;
+  struct mem_block *free;
+};
+
+struct mem_chunk
+{
+  struct mem_chunk *next;
+  size_t size;
+};
+
+static enum mem_allocator current_allocator;
+static struct mem_bucket buckets[MEM_BUCKETS];
+static int n_buckets;
+static struct mem_chunk *chunks;
+static char *chunk_pos;
+static size_t chunk_avail;
+
+static const char *const allocator_names[MEM_ALLOCATORS] = {
+  [MEM_DEFAULT] = "default",
+  [MEM_POOL] = "pool",
+  [MEM_HUGEPAGE] = "hugepage",
+};
+
+const char *
+mem_allocator_name (enum mem_allocator allocator)
+{
+  return allocator_names[allocator];
+}
+
+int
+mem_allocator_parse (const char *name, enum mem_allocator *allocator)
+{
+  int i;
+
+  for (i = 0; i < MEM_ALLOCATORS; i++)
+    if (strcmp (name, allocator_names[i]) == 0)
+      {
+        *allocator = i;
+        return 0;
+      }
+  return -1;
+}
+
+void
+mem_set_allocator (enum mem_allocator allocator)
+{
+  mem_pool_clear ();
+  current_allocator = allocator;
+}
+
+static void *
+map_huge (size_t size)
+{
+  void *p;
+
+#ifdef MAP_HUGETLB
+  p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+    return p;
+#endif
+  /* No reserved huge pages: fall back to transparent ones. */
+  p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+#ifdef MADV_HUGEPAGE
+  madvise (p, size, MADV_HUGEPAGE); /* ignore rc */
+#endif
+  return p;
+}
+
+/* Bump-allocate from huge pages.  Memory is only returned by clearing. */
+static void *
+huge_alloc (size_t size)
+{
+  struct mem_chunk *chunk;
+  size_t chunk_size;
+
+  size = (size + 15) & ~(size_t)15;
+  if (size > chunk_avail)
+    {
+      chunk_size = sizeof (struct mem_chunk) + size;
+      chunk_size = (chunk_size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+      chunk = map_huge (chunk_size);
+      if (!chunk)
+        return NULL;
+      chunk->next = chunks;
+      chunk->size = chunk_size;
+      chunks = chunk;
+      chunk_pos = (char *)chunk + MEM_HEADER;
+      chunk_avail = chunk_size - MEM_HEADER;
+    }
+  chunk_pos += size;
+  chunk_avail -= size;
+  return chunk_pos - size;
+}
+
+static int
+find_bucket (size_t size)
+{
+  int i;
+
+  for (i = 0; i < n_buckets; i++)
+    if (buckets[i].size == size)
+      return i;
+  if (n_buckets == MEM_BUCKETS)
+    return -1;
+  buckets[n_buckets].size = size;
+  buckets[n_buckets].free = NULL;
+  return n_buckets++;
+}
+
+static struct mem_header *
+pool_alloc (size_t size)
+{
+  struct mem_header *header;
+  struct mem_block *block;
+  int bucket;
+
+  bucket = find_bucket (size);
+  if (bucket != -1 && (block = buckets[bucket].free))
+    {
+      buckets[bucket].free = block->next;
+      header = (struct mem_header *)((char *)block - MEM_HEADER);
+      return header;
+    }
+  header = current_allocator == MEM_HUGEPAGE ? huge_alloc (MEM_HEADER + size)
+                                             : malloc (MEM_HEADER + size);
+  if (header)
+    header->bucket = bucket;
+  return header;
+}
+
+static void
+pool_free (struct mem_header *header)
+{
+  struct mem_block *block;
+
+  if (header->bucket == -1)
+    {
+      if (current_allocator != MEM_HUGEPAGE)
+        free (header);
+      return;
+    }
+  block = (struct mem_block *)((char *)header + MEM_HEADER);
+  block->next = buckets[header->bucket].free;
+  buckets[header->bucket].free = block;
+}
+
+void
+mem_pool_clear (void)
+{
+  struct mem_block *block;
+  struct mem_chunk *chunk;
+  int i;
+
+  for (i = 0; i < n_buckets; i++)
+    while ((block = buckets[i].free))
+      {
+        buckets[i].free = block->next;
+        if (current_allocator == MEM_POOL)
+          free ((char *)block - MEM_HEADER);
+      }
+  n_buckets = 0;
+  while ((chunk = chunks))
+    {
+      chunks = chunk->next;
+      munmap (chunk, chunk->size);
+    }
+  chunk_pos = NULL;
+  chunk_avail = 0;
+}
+
+voidpf
+mem_alloc (voidpf opaque, uInt items, uInt size)
+{
+  struct mem_stats *mem = opaque;
+  struct mem_header *header;
+  size_t n = (size_t)items * size;
+
+  if (current_allocator == MEM_DEFAULT)
+    header = malloc (MEM_HEADER + n);
+  else
+    header = pool_alloc (n);
+  if (!header)
+    return Z_NULL;
+  header->size = n;
+  mem->allocs++;
+  mem->bytes += n;
+  mem->live += n;
+  if (mem->live > mem->peak)
+    mem->peak = mem->live;
+  return (char *)header + MEM_HEADER;
+}
+
+void
+mem_free (voidpf opaque, voidpf address)
+{
+  struct mem_stats *mem = opaque;
+  struct mem_header *header
+      = (struct mem_header *)((char *)address - MEM_HEADER);
+
+  mem->live -= header->size;
+  if (current_allocator == MEM_DEFAULT)
+    free (header);
+  else
+    pool_free (header);
+}
+
+void
+mem_init (z_streamp strm, struct mem_stats *mem)
+{
+  memset (mem, 0, sizeof (*mem));
+  strm->zalloc = mem_alloc;
+  strm->zfree = mem_free;
+  strm->opaque = mem;
+}
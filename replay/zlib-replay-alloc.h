@@ -0,0 +1,41 @@
+#ifndef ZLIB_REPLAY_ALLOC_H
+#define ZLIB_REPLAY_ALLOC_H
+
+#include <zlib.h>
+
+/*
+ * Allocators for replayed streams.  All of them account allocations in the
+ * stream's mem_stats; they differ in where the memory comes from:
+ *
+ * default   malloc () and free ().
+ * pool      blocks are kept on per-size free lists and recycled across
+ *           streams, like pooled zalloc implementations do.
+ * hugepage  same as pool, but the blocks are carved out of huge pages.
+ */
+enum mem_allocator
+{
+  MEM_DEFAULT,
+  MEM_POOL,
+  MEM_HUGEPAGE,
+  MEM_ALLOCATORS
+};
+
+struct mem_stats
+{
+  unsigned long allocs;
+  unsigned long bytes;
+  unsigned long live;
+  unsigned long peak;
+};
+
+const char *mem_allocator_name (enum mem_allocator allocator);
+int mem_allocator_parse (const char *name, enum mem_allocator *allocator);
+void mem_set_allocator (enum mem_allocator allocator);
+/* Return all memory cached by the pool allocators to the system. */
+void mem_pool_clear (void);
+
+voidpf mem_alloc (voidpf opaque, uInt items, uInt size);
+void mem_free (voidpf opaque, voidpf address);
+void mem_init (z_streamp strm, struct mem_stats *mem);
+
+#endif
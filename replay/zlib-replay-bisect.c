@@ -0,0 +1,616 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "zlib-replay-bisect.h"
+#include "zlib-trace.h"
+
+#define PROBE_STEP (64 << 10)
+#define CONTEXT_SIZE 16
+
+/* The entry points of one zlib build. */
+struct zlib_build
+{
+  const char *path;
+  void *handle;
+  const char *(*version) (void);
+  int (*deflate_init) (z_streamp, int, int, int, int, int, const char *, int);
+  int (*deflate) (z_streamp, int);
+  int (*deflate_params) (z_streamp, int, int);
+  int (*deflate_reset) (z_streamp);
+  int (*deflate_copy) (z_streamp, z_streamp);
+  int (*deflate_end) (z_streamp);
+  int (*inflate_init) (z_streamp, int, const char *, int);
+  int (*inflate) (z_streamp, int);
+  int (*inflate_reset) (z_streamp);
+  int (*inflate_copy) (z_streamp, z_streamp);
+  int (*inflate_end) (z_streamp);
+};
+
+struct bisect_buffer
+{
+  Bytef *data;
+  size_t size;
+};
+
+struct bisect
+{
+  struct zlib_build builds[2];
+  struct trace trace;
+  const char *path;
+  char kind;
+  /* Index 0 is lib_a, index 1 is lib_b. */
+  z_stream live[2];
+  z_stream checkpoint[2];
+  int has_checkpoint;
+  uint64_t checkpoint_call; /* calls before the checkpoint */
+  /* Calls since the checkpoint. */
+  struct trace_record *window;
+  size_t n_window;
+  size_t window_cap;
+  struct bisect_buffer in;
+  struct bisect_buffer out[2];
+  struct bisect_buffer probe[2];
+  size_t probe_len[2];
+  int probes;
+  int interval;
+  const char *argv0;
+};
+
+static int
+load_symbol (struct zlib_build *build, const char *name, void **sym,
+             const char *argv0)
+{
+  *sym = dlsym (build->handle, name);
+  if (!*sym)
+    {
+      fprintf (stderr, "%s: %s: could not resolve %s\n", argv0, build->path,
+               name);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+
+#define LOAD(field, name)                                                     \
+  load_symbol (build, name, (void **)&build->field, argv0)
+
+static int
+build_open (struct zlib_build *build, const char *path, const char *argv0)
+{
+  int flags = RTLD_NOW | RTLD_LOCAL;
+
+#ifdef RTLD_DEEPBIND
+  /* Calls within the build must not go to the zlib that we link. */
+  flags |= RTLD_DEEPBIND;
+#endif
+  memset (build, 0, sizeof (*build));
+  build->path = path;
+  build->handle = dlopen (path, flags);
+  if (!build->handle)
+    {
+      fprintf (stderr, "%s: %s\n", argv0, dlerror ());
+      return EXIT_FAILURE;
+    }
+  if (LOAD (version, "zlibVersion") != EXIT_SUCCESS
+      || LOAD (deflate_init, "deflateInit2_") != EXIT_SUCCESS
+      || LOAD (deflate, "deflate") != EXIT_SUCCESS
+      || LOAD (deflate_params, "deflateParams") != EXIT_SUCCESS
+      || LOAD (deflate_reset, "deflateReset") != EXIT_SUCCESS
+      || LOAD (deflate_copy, "deflateCopy") != EXIT_SUCCESS
+      || LOAD (deflate_end, "deflateEnd") != EXIT_SUCCESS
+      || LOAD (inflate_init, "inflateInit2_") != EXIT_SUCCESS
+      || LOAD (inflate, "inflate") != EXIT_SUCCESS
+      || LOAD (inflate_reset, "inflateReset") != EXIT_SUCCESS
+      || LOAD (inflate_copy, "inflateCopy") != EXIT_SUCCESS
+      || LOAD (inflate_end, "inflateEnd") != EXIT_SUCCESS)
+    {
+      dlclose (build->handle);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+
+static Bytef *
+buffer_get (struct bisect_buffer *buf, size_t count)
+{
+  Bytef *data;
+
+  if (count + 1 > buf->size)
+    {
+      data = realloc (buf->data, count + 1);
+      if (!data)
+        return NULL;
+      buf->data = data;
+      buf->size = count + 1;
+    }
+  return buf->data;
+}
+
+static const char *
+call_name (char kind, const struct trace_call *call)
+{
+  switch (call->kind)
+    {
+    case 'p':
+      return "deflateParams";
+    case 'c':
+      return kind == 'd' ? "deflate" : "inflate";
+    default:
+      return kind == 'd' ? "deflateReset" : "inflateReset";
+    }
+}
+
+static void
+end_one (struct bisect *b, int i, z_streamp strm)
+{
+  if (b->kind == 'd')
+    b->builds[i].deflate_end (strm);
+  else
+    b->builds[i].inflate_end (strm);
+}
+
+static int
+pair_init (struct bisect *b, z_stream s[2])
+{
+  const struct trace_init *init = &b->trace.init;
+  const struct zlib_build *build;
+  int err;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    {
+      build = &b->builds[i];
+      memset (&s[i], 0, sizeof (s[i]));
+      err = b->kind == 'd'
+                ? build->deflate_init (&s[i], init->level, init->zmethod,
+                                       init->window_bits, init->mem_level,
+                                       init->strategy, build->version (),
+                                       (int)sizeof (z_stream))
+                : build->inflate_init (&s[i], init->window_bits,
+                                       build->version (),
+                                       (int)sizeof (z_stream));
+      if (err != Z_OK)
+        {
+          fprintf (stderr, "%s: %s: %s: init failed: %i\n", b->argv0,
+                   b->path, build->path, err);
+          if (i == 1)
+            end_one (b, 0, &s[0]);
+          return EXIT_FAILURE;
+        }
+    }
+  return EXIT_SUCCESS;
+}
+
+static int
+pair_copy (struct bisect *b, z_stream dest[2], z_stream source[2])
+{
+  const struct zlib_build *build;
+  int err;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    {
+      build = &b->builds[i];
+      err = b->kind == 'd' ? build->deflate_copy (&dest[i], &source[i])
+                           : build->inflate_copy (&dest[i], &source[i]);
+      if (err != Z_OK)
+        {
+          fprintf (stderr, "%s: %s: %s: copy failed: %i\n", b->argv0,
+                   b->path, build->path, err);
+          if (i == 1)
+            end_one (b, 0, &dest[0]);
+          return EXIT_FAILURE;
+        }
+    }
+  return EXIT_SUCCESS;
+}
+
+static void
+pair_end (struct bisect *b, z_stream s[2])
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+    end_one (b, i, &s[i]);
+}
+
+/* Print both byte strings around their first difference. */
+static void
+print_context (const Bytef *x, size_t x_len, const Bytef *y, size_t y_len)
+{
+  const Bytef *data[2] = { x, y };
+  size_t len[2] = { x_len, y_len };
+  size_t pos = 0;
+  size_t start;
+  size_t i;
+  int j;
+
+  while (pos < x_len && pos < y_len && x[pos] == y[pos])
+    pos++;
+  start = pos > CONTEXT_SIZE ? pos - CONTEXT_SIZE : 0;
+  printf ("  first difference at byte %zu (lengths %zu and %zu)\n", pos,
+          x_len, y_len);
+  for (j = 0; j < 2; j++)
+    {
+      printf ("  %c %8zx:", 'A' + j, start);
+      for (i = start; i < len[j] && i < pos + CONTEXT_SIZE; i++)
+        printf (i == pos ? " [%02x]" : " %02x", data[j][i]);
+      printf ("\n");
+    }
+}
+
+/*
+ * Issue the call on both streams of s.  Return 1 if the builds behave
+ * differently, 0 if not, and -1 on failure.  With report, describe the
+ * difference.
+ */
+static int
+step (struct bisect *b, z_stream s[2], const struct trace_record *record,
+      uint64_t n, int report)
+{
+  const struct trace_call *call = &record->call;
+  const char *what;
+  Bytef *next_in;
+  Bytef *next_out[2];
+  uInt consumed_in[2];
+  uInt consumed_out[2];
+  int err[2];
+  int i;
+
+  next_in = buffer_get (&b->in, call->avail_in);
+  next_out[0] = buffer_get (&b->out[0], call->avail_out);
+  next_out[1] = buffer_get (&b->out[1], call->avail_out);
+  if (!next_in || !next_out[0] || !next_out[1])
+    {
+      fprintf (stderr, "%s: oom\n", b->argv0);
+      return -1;
+    }
+  memcpy (next_in, call->in.data, call->in.len);
+  for (i = 0; i < 2; i++)
+    {
+      s[i].next_in = next_in;
+      s[i].avail_in = call->avail_in;
+      s[i].next_out = next_out[i];
+      s[i].avail_out = call->avail_out;
+      switch (call->kind)
+        {
+        case 'p':
+          err[i] = b->builds[i].deflate_params (&s[i], call->level,
+                                                call->strategy);
+          break;
+        case 'c':
+          err[i] = b->kind == 'd' ? b->builds[i].deflate (&s[i], call->flush)
+                                  : b->builds[i].inflate (&s[i], call->flush);
+          break;
+        default:
+          err[i] = b->kind == 'd' ? b->builds[i].deflate_reset (&s[i])
+                                  : b->builds[i].inflate_reset (&s[i]);
+          break;
+        }
+      consumed_in[i] = call->avail_in - s[i].avail_in;
+      consumed_out[i] = call->avail_out - s[i].avail_out;
+    }
+  if (err[0] != err[1])
+    what = "return values differ";
+  else if (consumed_in[0] != consumed_in[1])
+    what = "consumed input differs";
+  else if (consumed_out[0] != consumed_out[1]
+           || memcmp (next_out[0], next_out[1], consumed_out[0]) != 0)
+    what = "output differs";
+  else
+    return 0;
+  if (report)
+    {
+      printf ("%s: call %" PRIu64 " (%s at offset %" PRIu64
+              "): %s\n",
+              b->path, n, call_name (b->kind, call), record->offset, what);
+      for (i = 0; i < 2; i++)
+        printf ("  %c: returned %i, consumed %u bytes, produced %u bytes\n",
+                'A' + i, err[i], consumed_in[i], consumed_out[i]);
+      if (consumed_out[0] || consumed_out[1])
+        print_context (next_out[0], consumed_out[0], next_out[1],
+                       consumed_out[1]);
+    }
+  return 1;
+}
+
+/* What finishing a copy of the stream would produce: the pending state. */
+static int
+finish_copy (struct bisect *b, int i, z_streamp strm)
+{
+  const struct zlib_build *build = &b->builds[i];
+  size_t *len = &b->probe_len[i];
+  z_stream copy;
+  Bytef *data;
+  int err;
+
+  if (build->deflate_copy (&copy, strm) != Z_OK)
+    {
+      fprintf (stderr, "%s: %s: copy failed\n", b->argv0, build->path);
+      return EXIT_FAILURE;
+    }
+  copy.next_in = Z_NULL;
+  copy.avail_in = 0;
+  *len = 0;
+  do
+    {
+      data = buffer_get (&b->probe[i], *len + PROBE_STEP);
+      if (!data)
+        {
+          fprintf (stderr, "%s: oom\n", b->argv0);
+          build->deflate_end (&copy);
+          return EXIT_FAILURE;
+        }
+      copy.next_out = data + *len;
+      copy.avail_out = PROBE_STEP;
+      err = build->deflate (&copy, Z_FINISH);
+      *len += PROBE_STEP - copy.avail_out;
+    }
+  while (err == Z_OK);
+  build->deflate_end (&copy);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Compare the states of the streams of s after n calls, like step ().  The
+ * state that deflate has not output yet is compared by finishing copies.
+ */
+static int
+probe (struct bisect *b, z_stream s[2], uint64_t n, int report)
+{
+  int i;
+
+  b->probes++;
+  if (s[0].total_in != s[1].total_in || s[0].total_out != s[1].total_out
+      || s[0].adler != s[1].adler)
+    {
+      if (report)
+        {
+          printf ("%s: after call %" PRIu64 ": stream states differ\n",
+                  b->path, n);
+          for (i = 0; i < 2; i++)
+            printf ("  %c: total_in %lu, total_out %lu, adler %08lx\n",
+                    'A' + i, s[i].total_in, s[i].total_out, s[i].adler);
+        }
+      return 1;
+    }
+  if (b->kind != 'd')
+    return 0;
+  for (i = 0; i < 2; i++)
+    if (finish_copy (b, i, &s[i]) != EXIT_SUCCESS)
+      return -1;
+  if (b->probe_len[0] == b->probe_len[1]
+      && memcmp (b->probe[0].data, b->probe[1].data, b->probe_len[0]) == 0)
+    return 0;
+  if (report)
+    {
+      printf ("%s: after call %" PRIu64
+              ": pending states differ, as finishing the streams shows\n",
+              b->path, n);
+      print_context (b->probe[0].data, b->probe_len[0], b->probe[1].data,
+                     b->probe_len[1]);
+    }
+  return 1;
+}
+
+/*
+ * Replay the first n calls of the window on a copy of the checkpoint and
+ * compare the result.  If a call already differs, *first is set to it.
+ */
+static int
+replay_window (struct bisect *b, size_t n, size_t *first, int report)
+{
+  z_stream work[2];
+  size_t i;
+  int d = 0;
+
+  if (pair_copy (b, work, b->checkpoint) != EXIT_SUCCESS)
+    return -1;
+  for (i = 0; i < n && d == 0; i++)
+    d = step (b, work, &b->window[i], b->checkpoint_call + i + 1, report);
+  if (d == 0)
+    d = probe (b, work, b->checkpoint_call + n, report);
+  *first = i;
+  pair_end (b, work);
+  return d;
+}
+
+/*
+ * The builds agree at the checkpoint and differ after the window.  Bisect
+ * for the call after which they start to differ.
+ */
+static int
+locate (struct bisect *b)
+{
+  size_t lo = 0;
+  size_t hi = b->n_window;
+  size_t mid;
+  size_t first;
+  int d;
+
+  while (hi - lo > 1)
+    {
+      mid = lo + (hi - lo) / 2;
+      d = replay_window (b, mid, &first, 0);
+      if (d < 0)
+        return EXIT_FAILURE;
+      if (d > 0)
+        hi = first;
+      else
+        lo = mid;
+    }
+  printf ("%s: builds agree after call %" PRIu64
+          " and differ after call %" PRIu64 " (%d state comparisons)\n",
+          b->path, b->checkpoint_call + lo, b->checkpoint_call + hi,
+          b->probes);
+  if (replay_window (b, hi, &first, 1) < 0)
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+static int
+add_to_window (struct bisect *b, const struct trace_record *record)
+{
+  struct trace_record *window;
+  size_t cap;
+
+  if (b->n_window == b->window_cap)
+    {
+      cap = b->window_cap ? b->window_cap * 2 : 64;
+      window = realloc (b->window, cap * sizeof (*window));
+      if (!window)
+        return EXIT_FAILURE;
+      b->window = window;
+      b->window_cap = cap;
+    }
+  b->window[b->n_window++] = *record;
+  return EXIT_SUCCESS;
+}
+
+static int
+take_checkpoint (struct bisect *b, uint64_t n)
+{
+  if (b->has_checkpoint)
+    pair_end (b, b->checkpoint);
+  b->has_checkpoint = 0;
+  if (pair_copy (b, b->checkpoint, b->live) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  b->has_checkpoint = 1;
+  b->checkpoint_call = n;
+  b->n_window = 0;
+  return EXIT_SUCCESS;
+}
+
+/* Sets *diverged; returns EXIT_FAILURE only when bisecting is impossible. */
+static int
+bisect_trace (struct bisect *b, int *diverged)
+{
+  struct trace_record record;
+  uint64_t n = 0;
+  int eof = 0;
+  int ret = EXIT_FAILURE;
+  int d;
+
+  *diverged = 0;
+  b->probes = 0;
+  b->n_window = 0;
+  if (trace_open (&b->trace, b->path) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: %s\n", b->argv0, b->trace.error);
+      return EXIT_FAILURE;
+    }
+  if (b->trace.init.method == 'c')
+    {
+      /* Getting to the source state would need a bisection of its own. */
+      fprintf (stderr, "%s: skipping %s: copies are not supported\n",
+               b->argv0, b->path);
+      ret = EXIT_SUCCESS;
+      goto close_trace;
+    }
+  b->kind = b->trace.init.kind;
+  if (pair_init (b, b->live) != EXIT_SUCCESS)
+    goto close_trace;
+  d = probe (b, b->live, 0, 1);
+  if (d != 0)
+    {
+      *diverged = d > 0;
+      ret = d > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+      goto end;
+    }
+  if (take_checkpoint (b, 0) != EXIT_SUCCESS)
+    goto end;
+  while (!eof)
+    {
+      if (trace_next (&b->trace, &record, &eof) != EXIT_SUCCESS)
+        {
+          fprintf (stderr, "%s: %s: %s\n", b->argv0, b->path,
+                   b->trace.error);
+          goto end;
+        }
+      if (eof || record.type != TRACE_CALL)
+        continue;
+      if (add_to_window (b, &record) != EXIT_SUCCESS)
+        {
+          fprintf (stderr, "%s: oom\n", b->argv0);
+          goto end;
+        }
+      d = step (b, b->live, &record, ++n, 0);
+      if (d == 0 && b->n_window == (size_t)b->interval)
+        d = probe (b, b->live, n, 0);
+      if (d < 0)
+        goto end;
+      if (d > 0)
+        break;
+      if (b->n_window == (size_t)b->interval
+          && take_checkpoint (b, n) != EXIT_SUCCESS)
+        goto end;
+    }
+  if (d == 0 && b->n_window)
+    d = probe (b, b->live, n, 0);
+  if (d < 0)
+    goto end;
+  if (d > 0)
+    {
+      *diverged = 1;
+      ret = locate (b);
+    }
+  else
+    {
+      printf ("%s: builds agree on all %" PRIu64 " calls\n", b->path, n);
+      ret = EXIT_SUCCESS;
+    }
+end:
+  if (b->has_checkpoint)
+    pair_end (b, b->checkpoint);
+  b->has_checkpoint = 0;
+  pair_end (b, b->live);
+close_trace:
+  trace_close (&b->trace);
+  return ret;
+}
+
+int
+bisect_run (char **paths, int n_paths, const char *lib_a, const char *lib_b,
+            int interval, const char *argv0)
+{
+  struct bisect b;
+  int diverged;
+  int any_diverged = 0;
+  int ret = EXIT_FAILURE;
+  int i;
+
+  memset (&b, 0, sizeof (b));
+  b.interval = interval;
+  b.argv0 = argv0;
+  if (build_open (&b.builds[0], lib_a, argv0) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  if (build_open (&b.builds[1], lib_b, argv0) != EXIT_SUCCESS)
+    goto close_a;
+  printf ("A: %s (zlib %s)\nB: %s (zlib %s)\n", lib_a, b.builds[0].version (),
+          lib_b, b.builds[1].version ());
+  for (i = 0; i < n_paths; i++)
+    {
+      b.path = paths[i];
+      if (bisect_trace (&b, &diverged) != EXIT_SUCCESS)
+        goto out;
+      any_diverged |= diverged;
+    }
+  ret = any_diverged ? EXIT_FAILURE : EXIT_SUCCESS;
+out:
+  for (i = 0; i < 2; i++)
+    {
+      free (b.out[i].data);
+      free (b.probe[i].data);
+    }
+  free (b.in.data);
+  free (b.window);
+  dlclose (b.builds[1].handle);
+close_a:
+  dlclose (b.builds[0].handle);
+  return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef ZLIB_REPLAY_BISECT_H
+#define ZLIB_REPLAY_BISECT_H
+
+/*
+ * Replay traces on two zlib builds, the shared libraries lib_a and lib_b,
+ * in lockstep, and report the first call after which they behave
+ * differently.  Calls are compared as they go; every interval calls, the
+ * stream states are compared too, and when they differ, the call is found
+ * by bisecting from the last checkpoint at which they were the same.
+ */
+int bisect_run (char **paths, int n_paths, const char *lib_a,
+                const char *lib_b, int interval, const char *argv0);
+
+#endif
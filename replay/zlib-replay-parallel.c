@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "zlib-replay-parallel.h"
+#include "zlib-trace.h"
+
+#define DICTIONARY_SIZE 32768
+/* zlib counts bytes in uInt, so larger buffers are passed in pieces. */
+#define PIECE_MAX ((size_t)UINT_MAX)
+
+struct chunk
+{
+  const Bytef *in;
+  size_t in_len;
+  Bytef *out;
+  size_t out_len;
+  uLong check;
+};
+
+struct parallel_state
+{
+  const struct trace_init *init;
+  const Bytef *in;
+  size_t in_len;
+  struct chunk *chunks;
+  size_t n_chunks;
+  size_t bound;
+  atomic_size_t next_chunk;
+  int dictionary;
+  int gzip;
+  atomic_int err; /* set by the workers */
+};
+
+static double
+clock_s (clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime (clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Window size for the raw streams that the simulator uses.  zlib rejects raw
+ * streams with an 8-bit window, and itself uses 9 bits for zlib streams that
+ * ask for 8.
+ */
+static int
+window_size (int window_bits)
+{
+  int size = window_bits < 0 ? -window_bits : window_bits & 15;
+
+  return size == 8 ? 9 : size;
+}
+
+/* Bytes that the zlib or gzip wrapper adds around the deflate data. */
+static size_t
+wrapper_size (int window_bits)
+{
+  if (window_bits < 0)
+    return 0;
+  return window_bits > 15 ? 10 + 8 : 2 + 4;
+}
+
+static uInt
+piece (size_t len)
+{
+  return len < PIECE_MAX ? (uInt)len : UINT_MAX;
+}
+
+/*
+ * Deflate in_len bytes from in into out, which has room for out_size bytes,
+ * and end with flush.
+ */
+static int
+deflate_all (z_streamp strm, const Bytef *in, size_t in_len, Bytef *out,
+             size_t out_size, int flush, size_t *out_len)
+{
+  const Bytef *in_end = in + in_len;
+  Bytef *out_end = out + out_size;
+  int last;
+  int err;
+
+  *out_len = 0;
+  strm->next_in = (Bytef *)in;
+  strm->next_out = out;
+  for (;;)
+    {
+      last = (size_t)(in_end - strm->next_in) <= PIECE_MAX;
+      strm->avail_in = piece (in_end - strm->next_in);
+      strm->avail_out = piece (out_end - strm->next_out);
+      err = deflate (strm, last ? flush : Z_NO_FLUSH);
+      if (err == Z_STREAM_END)
+        break;
+      if (err != Z_OK)
+        return err;
+      if (last && flush != Z_FINISH && strm->avail_in == 0
+          && strm->avail_out != 0)
+        break;
+      if (strm->next_out == out_end)
+        return Z_BUF_ERROR;
+    }
+  *out_len = strm->next_out - out;
+  return Z_OK;
+}
+
+static int
+compress_chunk (struct parallel_state *state, z_streamp strm,
+                struct chunk *chunk, int last)
+{
+  size_t dict_len;
+  int err;
+
+  if (deflateReset (strm) != Z_OK)
+    return Z_STREAM_ERROR;
+  if (state->dictionary && chunk->in != state->in)
+    {
+      dict_len = chunk->in - state->in;
+      if (dict_len > DICTIONARY_SIZE)
+        dict_len = DICTIONARY_SIZE;
+      err = deflateSetDictionary (strm, chunk->in - dict_len, dict_len);
+      if (err != Z_OK)
+        return err;
+    }
+  /* Sync flush ends the chunk on a byte boundary, so chunks concatenate. */
+  err = deflate_all (strm, chunk->in, chunk->in_len, chunk->out,
+                     state->bound, last ? Z_FINISH : Z_SYNC_FLUSH,
+                     &chunk->out_len);
+  if (err != Z_OK)
+    return err;
+  chunk->check = state->gzip ? crc32_z (0, chunk->in, chunk->in_len)
+                             : adler32_z (1, chunk->in, chunk->in_len);
+  return Z_OK;
+}
+
+static void *
+parallel_worker (void *arg)
+{
+  struct parallel_state *state = arg;
+  const struct trace_init *init = state->init;
+  z_stream strm;
+  size_t i;
+  int err;
+
+  memset (&strm, 0, sizeof (strm));
+  err = deflateInit2 (&strm, init->level, init->zmethod,
+                      -window_size (init->window_bits), init->mem_level,
+                      init->strategy);
+  if (err != Z_OK)
+    {
+      atomic_store (&state->err, err);
+      return NULL;
+    }
+  while ((i = atomic_fetch_add (&state->next_chunk, 1)) < state->n_chunks)
+    {
+      err = compress_chunk (state, &strm, &state->chunks[i],
+                            i == state->n_chunks - 1);
+      if (err != Z_OK)
+        atomic_store (&state->err, err);
+    }
+  deflateEnd (&strm);
+  return NULL;
+}
+
+/* Check that the chunks decompress back to the input. */
+static int
+verify (struct parallel_state *state, int window_bits)
+{
+  Bytef *out;
+  z_stream strm;
+  const Bytef *in_end;
+  size_t i;
+  int err = Z_OK;
+
+  out = malloc (state->in_len + 1);
+  if (!out)
+    return Z_MEM_ERROR;
+  memset (&strm, 0, sizeof (strm));
+  if (inflateInit2 (&strm, -window_size (window_bits)) != Z_OK)
+    {
+      free (out);
+      return Z_STREAM_ERROR;
+    }
+  strm.next_out = out;
+  for (i = 0; i < state->n_chunks && err == Z_OK; i++)
+    {
+      strm.next_in = state->chunks[i].out;
+      in_end = strm.next_in + state->chunks[i].out_len;
+      do
+        {
+          strm.avail_in = piece (in_end - strm.next_in);
+          strm.avail_out = piece (out + state->in_len + 1 - strm.next_out);
+          err = inflate (&strm, Z_SYNC_FLUSH);
+        }
+      while (err == Z_OK
+             && (strm.next_in != in_end || strm.avail_out == 0)
+             && strm.next_out != out + state->in_len + 1);
+      if (err == Z_BUF_ERROR && state->chunks[i].out_len == 0)
+        err = Z_OK;
+    }
+  if (err == Z_STREAM_END && strm.total_out == state->in_len
+      && memcmp (out, state->in, state->in_len) == 0)
+    err = Z_OK;
+  else if (err == Z_OK || err == Z_STREAM_END)
+    err = Z_DATA_ERROR;
+  inflateEnd (&strm);
+  free (out);
+  return err;
+}
+
+/* Single-stream deflate with the recorded parameters, for reference. */
+static int
+serial_run (const struct trace_init *init, const Bytef *in, size_t in_len,
+            size_t *out_len, double *wall, double *cpu)
+{
+  z_stream strm;
+  Bytef *out;
+  size_t bound;
+  int err;
+
+  memset (&strm, 0, sizeof (strm));
+  if (deflateInit2 (&strm, init->level, init->zmethod,
+                    -window_size (init->window_bits), init->mem_level,
+                    init->strategy)
+      != Z_OK)
+    return Z_STREAM_ERROR;
+  bound = deflateBound (&strm, in_len) + 16;
+  out = malloc (bound);
+  if (!out)
+    {
+      deflateEnd (&strm);
+      return Z_MEM_ERROR;
+    }
+  *wall = clock_s (CLOCK_MONOTONIC);
+  *cpu = clock_s (CLOCK_PROCESS_CPUTIME_ID);
+  err = deflate_all (&strm, in, in_len, out, bound, Z_FINISH, out_len);
+  *wall = clock_s (CLOCK_MONOTONIC) - *wall;
+  *cpu = clock_s (CLOCK_PROCESS_CPUTIME_ID) - *cpu;
+  *out_len += wrapper_size (init->window_bits);
+  deflateEnd (&strm);
+  free (out);
+  return err;
+}
+
+/*
+ * The simulation compresses the whole input with the init parameters, so it
+ * does not apply to streams that change them with deflateParams () or start
+ * over with deflateReset ().
+ */
+static int
+check_calls (struct trace *trace, const char *path, const char *argv0)
+{
+  struct trace_record record;
+  int eof = 0;
+
+  for (;;)
+    {
+      if (trace_next (trace, &record, &eof) != EXIT_SUCCESS)
+        {
+          fprintf (stderr, "%s: %s\n", argv0, trace->error);
+          return EXIT_FAILURE;
+        }
+      if (eof)
+        return EXIT_SUCCESS;
+      if (record.type == TRACE_CALL
+          && (record.call.kind == 'p' || record.call.kind == 'r'))
+        {
+          fprintf (stderr,
+                   "%s: %s calls deflateParams or deflateReset, which "
+                   "is not supported\n",
+                   argv0, path);
+          return EXIT_FAILURE;
+        }
+    }
+}
+
+int
+parallel_run (const char *path, int threads, size_t chunk_size,
+              int dictionary, const char *argv0)
+{
+  struct parallel_state state;
+  struct trace trace;
+  const struct trace_init *init = &trace.init;
+  pthread_t *tids = NULL;
+  Bytef *out = NULL;
+  size_t serial_len;
+  size_t parallel_len;
+  size_t bound;
+  size_t i;
+  uLong check;
+  double serial_wall;
+  double serial_cpu;
+  double wall;
+  double cpu;
+  int err;
+  int ret = EXIT_FAILURE;
+
+  if (trace_open (&trace, path) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: %s\n", argv0, trace.error);
+      return EXIT_FAILURE;
+    }
+  if (init->kind != 'd' || init->method == 'c')
+    {
+      fprintf (stderr, "%s: %s is not a deflateInit trace\n", argv0, path);
+      goto close_trace;
+    }
+  if (check_calls (&trace, path, argv0) != EXIT_SUCCESS)
+    goto close_trace;
+  memset (&state, 0, sizeof (state));
+  atomic_init (&state.err, Z_OK);
+  state.init = init;
+  state.in = trace.in.data;
+  state.in_len = trace.in.len;
+  state.dictionary = dictionary;
+  state.gzip = init->window_bits > 15;
+  state.n_chunks = (trace.in.len + chunk_size - 1) / chunk_size;
+  if (state.n_chunks == 0)
+    state.n_chunks = 1;
+  atomic_init (&state.next_chunk, 0);
+
+  err = serial_run (init, state.in, state.in_len, &serial_len, &serial_wall,
+                    &serial_cpu);
+  if (err != Z_OK)
+    {
+      fprintf (stderr, "%s: serial deflate failed: %i\n", argv0, err);
+      goto close_trace;
+    }
+
+  /*
+   * Chunks compress into slices of one buffer, sized for the worst case:
+   * stored blocks plus the sync flush marker.
+   */
+  state.chunks = calloc (state.n_chunks, sizeof (*state.chunks));
+  bound = chunk_size + (chunk_size >> 3) + (chunk_size >> 6) + 64;
+  state.bound = bound;
+  out = malloc (state.n_chunks * bound);
+  tids = calloc (threads, sizeof (*tids));
+  if (!state.chunks || !out || !tids)
+    {
+      fprintf (stderr, "%s: oom\n", argv0);
+      goto free_state;
+    }
+  for (i = 0; i < state.n_chunks; i++)
+    {
+      state.chunks[i].in = state.in + i * chunk_size;
+      state.chunks[i].in_len = i == state.n_chunks - 1
+                                   ? state.in_len - i * chunk_size
+                                   : chunk_size;
+      state.chunks[i].out = out + i * bound;
+    }
+  wall = clock_s (CLOCK_MONOTONIC);
+  cpu = clock_s (CLOCK_PROCESS_CPUTIME_ID);
+  for (i = 0; i < (size_t)threads; i++)
+    if (pthread_create (&tids[i], NULL, parallel_worker, &state) != 0)
+      {
+        fprintf (stderr, "%s: pthread_create() failed\n", argv0);
+        threads = i;
+        atomic_store (&state.err, Z_ERRNO);
+        break;
+      }
+  for (i = 0; i < (size_t)threads; i++)
+    pthread_join (tids[i], NULL);
+  /* Combining the check values is part of what pigz has to do as well. */
+  check = state.gzip ? crc32 (0, NULL, 0) : adler32 (0, NULL, 0);
+  parallel_len = wrapper_size (init->window_bits);
+  for (i = 0; i < state.n_chunks; i++)
+    {
+      check = state.gzip
+                  ? crc32_combine (check, state.chunks[i].check,
+                                   state.chunks[i].in_len)
+                  : adler32_combine (check, state.chunks[i].check,
+                                     state.chunks[i].in_len);
+      parallel_len += state.chunks[i].out_len;
+    }
+  wall = clock_s (CLOCK_MONOTONIC) - wall;
+  cpu = clock_s (CLOCK_PROCESS_CPUTIME_ID) - cpu;
+  err = atomic_load (&state.err);
+  if (err != Z_OK)
+    {
+      fprintf (stderr, "%s: chunk deflate failed: %i\n", argv0, err);
+      goto free_state;
+    }
+  err = verify (&state, init->window_bits);
+  if (err != Z_OK)
+    {
+      fprintf (stderr, "%s: chunks do not decompress to the input: %i\n",
+               argv0, err);
+      goto free_state;
+    }
+
+  printf ("input: %zu bytes, recorded output: %zu bytes, check: 0x%08lx\n",
+          trace.in.len, trace.out.len, check);
+  printf ("%-8s %7s %6s %10s %10s %12s %9s %7s %10s\n", "mode", "threads",
+          "chunks", "wall, s", "cpu, s", "output", "vs rec", "speedup",
+          "efficiency");
+  printf ("%-8s %7d %6d %10.6f %10.6f %12zu %+8.2f%% %6.2fx %9.1f%%\n",
+          "serial", 1, 1, serial_wall, serial_cpu, serial_len,
+          trace.out.len ? 100.0 * serial_len / trace.out.len - 100 : 0., 1.,
+          100.);
+  printf ("%-8s %7d %6zu %10.6f %10.6f %12zu %+8.2f%% %6.2fx %9.1f%%\n",
+          dictionary ? "dict" : "indep", threads, state.n_chunks, wall, cpu,
+          parallel_len,
+          trace.out.len ? 100.0 * parallel_len / trace.out.len - 100 : 0.,
+          serial_wall / wall, 100.0 * serial_wall / wall / threads);
+  ret = EXIT_SUCCESS;
+free_state:
+  free (tids);
+  free (out);
+  free (state.chunks);
+close_trace:
+  trace_close (&trace);
+  return ret;
+}
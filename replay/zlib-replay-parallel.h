@@ -0,0 +1,15 @@
+#ifndef ZLIB_REPLAY_PARALLEL_H
+#define ZLIB_REPLAY_PARALLEL_H
+
+#include <stddef.h>
+
+/*
+ * Compress the concatenated input of a deflate trace pigz-style: in
+ * independent chunks on a thread pool, optionally priming each chunk with
+ * the end of the previous one as a dictionary, and compare wall time, CPU
+ * time and ratio with single-stream deflate.
+ */
+int parallel_run (const char *path, int threads, size_t chunk_size,
+                  int dictionary, const char *argv0);
+
+#endif
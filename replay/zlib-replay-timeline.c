@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "zlib-replay-timeline.h"
+#include "zlib-trace.h"
+
+struct timeline_buffer
+{
+  void *data;
+  size_t size;
+};
+
+struct timeline_stream
+{
+  struct trace trace;
+  const char *path;
+  z_stream strm;
+  int initialized; /* strm needs stream_end () */
+  /* Calls of a stream may be issued by different threads, but in order. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t done;
+  int failed;
+  struct timeline_buffer in_buf;
+  struct timeline_buffer out_buf;
+};
+
+struct timeline_call
+{
+  struct timeline_stream *stream;
+  struct trace_call call;
+  uint64_t seq; /* within the stream */
+  int last;
+  int timed;
+  struct trace_time time;
+  uint64_t replay_ns;
+  uint64_t lag_ns;
+};
+
+struct timeline_thread
+{
+  struct timeline *timeline;
+  uint64_t tid;
+  size_t *calls;
+  size_t n_calls;
+  pthread_t thread;
+};
+
+struct timeline
+{
+  struct timeline_stream *streams;
+  int n_streams;
+  struct timeline_call *calls;
+  size_t n_calls;
+  struct timeline_thread *threads;
+  size_t n_threads;
+  uint64_t recorded_start;
+  uint64_t recorded_end;
+  uint64_t replay_start;
+  double speed;
+  atomic_int failures;
+  atomic_int aborted; /* not all threads could be started */
+  const char *argv0;
+};
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until (uint64_t deadline)
+{
+  struct timespec ts;
+  uint64_t now;
+
+  while ((now = now_ns ()) < deadline)
+    {
+      ts.tv_sec = (deadline - now) / 1000000000;
+      ts.tv_nsec = (deadline - now) % 1000000000;
+      nanosleep (&ts, NULL);
+    }
+}
+
+static void *
+buffer_get (struct timeline_buffer *buf, size_t count)
+{
+  void *data;
+
+  if (count > buf->size)
+    {
+      data = realloc (buf->data, count);
+      if (!data)
+        return NULL;
+      buf->data = data;
+      buf->size = count;
+    }
+  return buf->data;
+}
+
+static int
+add_call (struct timeline *timeline, size_t *cap)
+{
+  struct timeline_call *calls;
+
+  if (timeline->n_calls == *cap)
+    {
+      *cap = *cap ? *cap * 2 : 1024;
+      calls = realloc (timeline->calls, *cap * sizeof (*calls));
+      if (!calls)
+        return EXIT_FAILURE;
+      timeline->calls = calls;
+    }
+  memset (&timeline->calls[timeline->n_calls++], 0,
+          sizeof (*timeline->calls));
+  return EXIT_SUCCESS;
+}
+
+/* Read the calls of a trace; they keep pointing into its mappings. */
+static int
+load_stream (struct timeline *timeline, struct timeline_stream *stream,
+             size_t *cap)
+{
+  struct trace_record record;
+  struct timeline_call *call;
+  size_t first = timeline->n_calls;
+  size_t i;
+  uint64_t seq = 0;
+  int eof = 0;
+
+  if (trace_open (&stream->trace, stream->path) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: %s\n", timeline->argv0, stream->trace.error);
+      return EXIT_FAILURE;
+    }
+  if (stream->trace.init.method == 'c')
+    {
+      /* The source state at the time of the copy is not reproducible. */
+      fprintf (stderr, "%s: skipping %s: copies are not supported\n",
+               timeline->argv0, stream->path);
+      return EXIT_SUCCESS;
+    }
+  for (;;)
+    {
+      if (trace_next (&stream->trace, &record, &eof) != EXIT_SUCCESS)
+        {
+          fprintf (stderr, "%s: %s: %s\n", timeline->argv0, stream->path,
+                   stream->trace.error);
+          return EXIT_FAILURE;
+        }
+      if (eof)
+        break;
+      if (record.type == TRACE_CALL)
+        {
+          if (add_call (timeline, cap) != EXIT_SUCCESS)
+            {
+              fprintf (stderr, "%s: oom\n", timeline->argv0);
+              return EXIT_FAILURE;
+            }
+          call = &timeline->calls[timeline->n_calls - 1];
+          call->stream = stream;
+          call->call = record.call;
+          call->seq = seq++;
+        }
+      else if (record.type == TRACE_TIME && timeline->n_calls > first)
+        {
+          call = &timeline->calls[timeline->n_calls - 1];
+          call->time = record.time;
+          call->timed = 1;
+        }
+    }
+  for (i = first; i < timeline->n_calls; i++)
+    if (!timeline->calls[i].timed)
+      {
+        fprintf (stderr, "%s: %s has no call timing, record it again\n",
+                 timeline->argv0, stream->path);
+        return EXIT_FAILURE;
+      }
+  if (timeline->n_calls > first)
+    timeline->calls[timeline->n_calls - 1].last = 1;
+  return EXIT_SUCCESS;
+}
+
+static struct timeline *sort_timeline;
+
+static int
+compare_calls (const void *a, const void *b)
+{
+  const struct timeline_call *x = &sort_timeline->calls[*(const size_t *)a];
+  const struct timeline_call *y = &sort_timeline->calls[*(const size_t *)b];
+
+  if (x->time.start_ns != y->time.start_ns)
+    return x->time.start_ns < y->time.start_ns ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+static struct timeline_thread *
+find_thread (struct timeline *timeline, uint64_t tid)
+{
+  size_t i;
+
+  for (i = 0; i < timeline->n_threads; i++)
+    if (timeline->threads[i].tid == tid)
+      return &timeline->threads[i];
+  return NULL;
+}
+
+/* Give each recorded thread its calls in the order they were issued. */
+static int
+assign_threads (struct timeline *timeline)
+{
+  struct timeline_thread *thread;
+  struct timeline_call *call;
+  size_t i;
+
+  timeline->threads
+      = calloc (timeline->n_calls + 1, sizeof (*timeline->threads));
+  if (!timeline->threads)
+    return EXIT_FAILURE;
+  timeline->recorded_start = UINT64_MAX;
+  for (i = 0; i < timeline->n_calls; i++)
+    {
+      call = &timeline->calls[i];
+      if (call->time.start_ns < timeline->recorded_start)
+        timeline->recorded_start = call->time.start_ns;
+      if (call->time.start_ns + call->time.duration_ns
+          > timeline->recorded_end)
+        timeline->recorded_end
+            = call->time.start_ns + call->time.duration_ns;
+      thread = find_thread (timeline, call->time.tid);
+      if (!thread)
+        {
+          thread = &timeline->threads[timeline->n_threads++];
+          thread->timeline = timeline;
+          thread->tid = call->time.tid;
+        }
+      thread->n_calls++;
+    }
+  for (i = 0; i < timeline->n_threads; i++)
+    {
+      thread = &timeline->threads[i];
+      thread->calls = malloc (thread->n_calls * sizeof (*thread->calls));
+      if (!thread->calls)
+        return EXIT_FAILURE;
+      thread->n_calls = 0;
+    }
+  for (i = 0; i < timeline->n_calls; i++)
+    {
+      thread = find_thread (timeline, timeline->calls[i].time.tid);
+      thread->calls[thread->n_calls++] = i;
+    }
+  sort_timeline = timeline;
+  for (i = 0; i < timeline->n_threads; i++)
+    qsort (timeline->threads[i].calls, timeline->threads[i].n_calls,
+           sizeof (size_t), compare_calls);
+  return EXIT_SUCCESS;
+}
+
+static int
+stream_init (struct timeline_stream *stream)
+{
+  const struct trace_init *init = &stream->trace.init;
+
+  int err;
+
+  memset (&stream->strm, 0, sizeof (stream->strm));
+  if (init->kind == 'd' && init->method == '1')
+    err = deflateInit (&stream->strm, init->level);
+  else if (init->kind == 'd')
+    err = deflateInit2 (&stream->strm, init->level, init->zmethod,
+                        init->window_bits, init->mem_level, init->strategy);
+  else if (init->method == '1')
+    err = inflateInit (&stream->strm);
+  else
+    err = inflateInit2 (&stream->strm, init->window_bits);
+  stream->initialized = err == Z_OK;
+  return err;
+}
+
+static void
+stream_end (struct timeline_stream *stream)
+{
+  if (!stream->initialized)
+    return;
+  if (stream->trace.init.kind == 'd')
+    deflateEnd (&stream->strm);
+  else
+    inflateEnd (&stream->strm);
+  stream->initialized = 0;
+}
+
+/* Issue a call and check that it behaves as recorded. */
+static int
+replay_call (struct timeline *timeline, struct timeline_call *tc)
+{
+  struct timeline_stream *stream = tc->stream;
+  const struct trace_call *call = &tc->call;
+  z_streamp strm = &stream->strm;
+  char kind = stream->trace.init.kind;
+  Bytef *next_in;
+  Bytef *next_out;
+  uint64_t start;
+  int z_err;
+
+  if (call->in.len == call->avail_in)
+    next_in = (Bytef *)call->in.data;
+  else if ((next_in = buffer_get (&stream->in_buf, call->avail_in)))
+    memcpy (next_in, call->in.data, call->in.len);
+  next_out = buffer_get (&stream->out_buf, call->avail_out);
+  if ((call->avail_in && !next_in) || (call->avail_out && !next_out))
+    {
+      fprintf (stderr, "%s: oom\n", timeline->argv0);
+      return EXIT_FAILURE;
+    }
+  strm->next_in = next_in;
+  strm->avail_in = call->avail_in;
+  strm->next_out = next_out;
+  strm->avail_out = call->avail_out;
+  start = now_ns ();
+  switch (call->kind)
+    {
+    case 'p':
+      z_err = deflateParams (strm, call->level, call->strategy);
+      break;
+    case 'c':
+      z_err = kind == 'd' ? deflate (strm, call->flush)
+                          : inflate (strm, call->flush);
+      break;
+    default:
+      z_err = kind == 'd' ? deflateReset (strm) : inflateReset (strm);
+      break;
+    }
+  tc->replay_ns = now_ns () - start;
+  if (z_err != call->err
+      || call->avail_in - strm->avail_in != call->consumed_in
+      || call->avail_out - strm->avail_out != call->consumed_out
+      || memcmp (next_out, call->out.data, call->consumed_out) != 0)
+    {
+      fprintf (stderr, "%s: %s: call %lu does not match the recording\n",
+               timeline->argv0, stream->path, (unsigned long)tc->seq);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+
+static void *
+timeline_worker (void *arg)
+{
+  struct timeline_thread *thread = arg;
+  struct timeline *timeline = thread->timeline;
+  struct timeline_stream *stream;
+  struct timeline_call *call;
+  uint64_t scheduled;
+  uint64_t start;
+  size_t i;
+  int failed;
+
+  for (i = 0; i < thread->n_calls; i++)
+    {
+      call = &timeline->calls[thread->calls[i]];
+      stream = call->stream;
+      scheduled = timeline->replay_start;
+      if (timeline->speed > 0)
+        {
+          scheduled += (uint64_t)((call->time.start_ns
+                                   - timeline->recorded_start)
+                                  / timeline->speed);
+          sleep_until (scheduled);
+        }
+      pthread_mutex_lock (&stream->lock);
+      while (stream->done != call->seq && !stream->failed
+             && !atomic_load (&timeline->aborted))
+        pthread_cond_wait (&stream->cond, &stream->lock);
+      failed = stream->failed || stream->done != call->seq;
+      pthread_mutex_unlock (&stream->lock);
+      if (failed)
+        continue;
+      start = now_ns ();
+      call->lag_ns = start > scheduled ? start - scheduled : 0;
+      if (call->seq == 0 && stream_init (stream) != Z_OK)
+        {
+          fprintf (stderr, "%s: %s: init failed\n", timeline->argv0,
+                   stream->path);
+          failed = 1;
+        }
+      else if (replay_call (timeline, call) != EXIT_SUCCESS)
+        failed = 1;
+      if (failed || call->last)
+        stream_end (stream);
+      if (failed)
+        atomic_fetch_add (&timeline->failures, 1);
+      pthread_mutex_lock (&stream->lock);
+      stream->done++;
+      stream->failed = failed;
+      pthread_cond_broadcast (&stream->cond);
+      pthread_mutex_unlock (&stream->lock);
+    }
+  return NULL;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us (const uint64_t *sorted, size_t n, double p)
+{
+  size_t i = (size_t)(p * n);
+
+  if (n == 0)
+    return 0;
+  return sorted[i < n ? i : n - 1] / 1e3;
+}
+
+static void
+print_latency (const char *name, uint64_t *ns, size_t n, double span_s,
+               uint64_t bytes)
+{
+  qsort (ns, n, sizeof (*ns), compare_u64);
+  printf ("%-9s %9.3f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, span_s,
+          span_s > 0 ? bytes / span_s / 1e6 : 0., percentile_us (ns, n, .5),
+          percentile_us (ns, n, .9), percentile_us (ns, n, .99),
+          percentile_us (ns, n, .999), n ? ns[n - 1] / 1e3 : 0.);
+}
+
+static void
+print_report (struct timeline *timeline, uint64_t replay_end)
+{
+  const struct timeline_call *call;
+  uint64_t *ns;
+  uint64_t bytes = 0;
+  size_t i;
+
+  ns = malloc ((timeline->n_calls + 1) * sizeof (*ns));
+  if (!ns)
+    return;
+  /* Throughput is in uncompressed bytes. */
+  for (i = 0; i < timeline->n_calls; i++)
+    {
+      call = &timeline->calls[i];
+      bytes += call->stream->trace.init.kind == 'd' ? call->call.consumed_in
+                                                     : call->call.consumed_out;
+    }
+  printf ("streams: %d, threads: %zu, calls: %zu, uncompressed: %llu bytes, "
+          "speed: ",
+          timeline->n_streams, timeline->n_threads, timeline->n_calls,
+          (unsigned long long)bytes);
+  if (timeline->speed > 0)
+    printf ("%.2fx\n", timeline->speed);
+  else
+    printf ("max\n");
+  printf ("%-9s %9s %9s %9s %9s %9s %9s %9s\n", "", "span, s", "MB/s",
+          "p50, us", "p90, us", "p99, us", "p99.9, us", "max, us");
+  for (i = 0; i < timeline->n_calls; i++)
+    ns[i] = timeline->calls[i].time.duration_ns;
+  print_latency ("recorded", ns, timeline->n_calls,
+                 (timeline->recorded_end - timeline->recorded_start) / 1e9,
+                 bytes);
+  for (i = 0; i < timeline->n_calls; i++)
+    ns[i] = timeline->calls[i].replay_ns;
+  print_latency ("replayed", ns, timeline->n_calls,
+                 (replay_end - timeline->replay_start) / 1e9, bytes);
+  if (timeline->speed > 0)
+    {
+      /* How late calls started, because of waiting for other threads. */
+      for (i = 0; i < timeline->n_calls; i++)
+        ns[i] = timeline->calls[i].lag_ns;
+      qsort (ns, timeline->n_calls, sizeof (*ns), compare_u64);
+      printf ("start lag: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+              percentile_us (ns, timeline->n_calls, .5),
+              percentile_us (ns, timeline->n_calls, .99),
+              timeline->n_calls ? ns[timeline->n_calls - 1] / 1e3 : 0.);
+    }
+  free (ns);
+}
+
+int
+timeline_run (char **paths, int n_paths, double speed, const char *argv0)
+{
+  struct timeline timeline;
+  struct timeline_stream *stream;
+  size_t cap = 0;
+  size_t started;
+  size_t i;
+  int ret = EXIT_FAILURE;
+
+  memset (&timeline, 0, sizeof (timeline));
+  timeline.speed = speed;
+  timeline.argv0 = argv0;
+  atomic_init (&timeline.failures, 0);
+  atomic_init (&timeline.aborted, 0);
+  timeline.streams = calloc (n_paths, sizeof (*timeline.streams));
+  if (!timeline.streams)
+    {
+      fprintf (stderr, "%s: oom\n", argv0);
+      return EXIT_FAILURE;
+    }
+  for (; timeline.n_streams < n_paths; timeline.n_streams++)
+    {
+      stream = &timeline.streams[timeline.n_streams];
+      stream->path = paths[timeline.n_streams];
+      pthread_mutex_init (&stream->lock, NULL);
+      pthread_cond_init (&stream->cond, NULL);
+      if (load_stream (&timeline, stream, &cap) != EXIT_SUCCESS)
+        {
+          timeline.n_streams++;
+          goto free_timeline;
+        }
+    }
+  if (assign_threads (&timeline) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: oom\n", argv0);
+      goto free_timeline;
+    }
+
+  timeline.replay_start = now_ns ();
+  for (started = 0; started < timeline.n_threads; started++)
+    if (pthread_create (&timeline.threads[started].thread, NULL,
+                        timeline_worker, &timeline.threads[started])
+        != 0)
+      {
+        /* Calls of the started threads could wait forever for the others. */
+        fprintf (stderr, "%s: pthread_create() failed\n", argv0);
+        atomic_store (&timeline.aborted, 1);
+        for (i = 0; i < (size_t)timeline.n_streams; i++)
+          {
+            stream = &timeline.streams[i];
+            pthread_mutex_lock (&stream->lock);
+            pthread_cond_broadcast (&stream->cond);
+            pthread_mutex_unlock (&stream->lock);
+          }
+        break;
+      }
+  for (i = 0; i < started; i++)
+    pthread_join (timeline.threads[i].thread, NULL);
+  if (atomic_load (&timeline.aborted))
+    goto free_timeline;
+  print_report (&timeline, now_ns ());
+  if (atomic_load (&timeline.failures) == 0)
+    ret = EXIT_SUCCESS;
+free_timeline:
+  if (timeline.threads)
+    for (i = 0; i < timeline.n_threads; i++)
+      free (timeline.threads[i].calls);
+  free (timeline.threads);
+  free (timeline.calls);
+  for (i = 0; i < (size_t)timeline.n_streams; i++)
+    {
+      stream = &timeline.streams[i];
+      stream_end (stream);
+      free (stream->in_buf.data);
+      free (stream->out_buf.data);
+      pthread_cond_destroy (&stream->cond);
+      pthread_mutex_destroy (&stream->lock);
+      trace_close (&stream->trace);
+    }
+  free (timeline.streams);
+  return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef ZLIB_REPLAY_TIMELINE_H
+#define ZLIB_REPLAY_TIMELINE_H
+
+/*
+ * Replay traces concurrently, reproducing the recorded timeline: each
+ * recorded thread gets a replay thread, which issues its calls at the
+ * recorded times divided by speed (as fast as possible if speed is 0).
+ * Report throughput and call latency against the recorded ones.
+ */
+int timeline_run (char **paths, int n_paths, double speed, const char *argv0);
+
+#endif
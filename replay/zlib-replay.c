@@ -1,25 +1,85 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
 #include <memory.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <zlib.h>
 
+#include "zlib-replay-alloc.h"
+#include "zlib-replay-bisect.h"
+#include "zlib-replay-parallel.h"
+#include "zlib-replay-timeline.h"
+#include "zlib-trace.h"
+
+/* Reusable buffer for the data of the current call. */
+struct replay_buffer
+{
+  void *data;
+  size_t size;
+};
+
 struct replay_state
 {
-  FILE *mfp;
-  FILE *ifp;
-  FILE *ofp;
+  struct trace trace;
   z_stream strm;
   char kind;
+  int level;
+  int method;
+  int window_bits;
+  int mem_level;
+  int strategy;
+  struct mem_stats mem;
+  struct mem_stats recorded_mem;
+  struct replay_buffer in_buf;
+  struct replay_buffer out_buf;
+  int cut; /* the trace ended before the stream did */
 };
 
 static int replay_run (struct replay_state *replay, const char *path,
-                       unsigned long end_off, const char *argv0);
+                       uint64_t end_off, const char *argv0);
 static int replay_end (struct replay_state *replay);
 
 #define PAGE_SIZE 0x1000
 #define PAGE_OFFSET_MASK 0xfff
 
+/* Calls with larger buffers are replayed in bounded memory. */
+static size_t piece_size = 64 << 20;
+
+static uint64_t zlib_ns;
+static uint64_t zlib_start_ns;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+timer_start (void)
+{
+  zlib_start_ns = now_ns ();
+}
+
+static int
+timer_stop (int z_err)
+{
+  zlib_ns += now_ns () - zlib_start_ns;
+  return z_err;
+}
+
+/* Evaluate a zlib call, accounting the time it takes in zlib_ns. */
+#define TIMED(x) (timer_start (), timer_stop (x))
+
 static const char *
 stream_kind (char kind)
 {
@@ -29,26 +89,28 @@ stream_kind (char kind)
 static int
 replay_copy (struct replay_state *replay, int *z_err, const char *argv0)
 {
-  char source_path[256];
-  unsigned long source_off;
+  const struct trace_init *init = &replay->trace.init;
   struct replay_state replay_source;
   int err;
 
-  if (fscanf (replay->mfp, "%256s %lu", source_path, &source_off) != 2)
-    {
-      fprintf (stderr, "%s: could not read %sCopy arguments\n", argv0,
-               stream_kind (replay->kind));
-      return EXIT_FAILURE;
-    }
-  err = replay_run (&replay_source, source_path, source_off, argv0);
+  err = replay_run (&replay_source, init->copy_path, init->copy_offset,
+                    argv0);
   if (err != EXIT_SUCCESS)
     {
-      fprintf (stderr, "%s: run %s failed\n", argv0, source_path);
+      fprintf (stderr, "%s: run %s failed\n", argv0, init->copy_path);
       return EXIT_FAILURE;
     }
+  replay->level = replay_source.level;
+  replay->method = replay_source.method;
+  replay->window_bits = replay_source.window_bits;
+  replay->mem_level = replay_source.mem_level;
+  replay->strategy = replay_source.strategy;
+  /* Account the copy's allocations to the new stream. */
+  replay_source.strm.opaque = &replay->mem;
   *z_err = replay->kind == 'd'
-               ? deflateCopy (&replay->strm, &replay_source.strm)
-               : inflateCopy (&replay->strm, &replay_source.strm);
+               ? TIMED (deflateCopy (&replay->strm, &replay_source.strm))
+               : TIMED (inflateCopy (&replay->strm, &replay_source.strm));
+  replay_source.strm.opaque = &replay_source.mem;
   replay_end (&replay_source); /* ignore rc */
   return EXIT_SUCCESS;
 }
@@ -56,386 +118,1397 @@ replay_copy (struct replay_state *replay, int *z_err, const char *argv0)
 static int
 replay_init (struct replay_state *replay, const char *argv0)
 {
-  char init_method[2];
-  int level;
-  int method;
-  int window_bits;
-  int mem_level;
-  int strategy;
+  const struct trace_init *init = &replay->trace.init;
   int err;
 
   memset (&replay->strm, 0, sizeof (replay->strm));
-  if (fscanf (replay->mfp, "%c", &replay->kind) != 1)
+  mem_init (&replay->strm, &replay->mem);
+  memset (&replay->recorded_mem, 0, sizeof (replay->recorded_mem));
+  replay->kind = init->kind;
+  replay->level = init->level;
+  replay->method = init->zmethod;
+  replay->window_bits = init->window_bits;
+  replay->mem_level = init->mem_level;
+  replay->strategy = init->strategy;
+  if (init->method == 'c')
     {
-      fprintf (stderr, "%s: could not read stream type\n", argv0);
-      return EXIT_FAILURE;
-    }
-  if (fscanf (replay->mfp, "%1s", init_method) != 1)
-    {
-      fprintf (stderr, "%s: could not read init method\n", argv0);
-      return EXIT_FAILURE;
+      if (replay_copy (replay, &err, argv0) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
     }
-  if (replay->kind == 'd' && init_method[0] == '1')
+  else if (replay->kind == 'd' && init->method == '1')
+    err = TIMED (deflateInit (&replay->strm, init->level));
+  else if (replay->kind == 'd')
+    err = TIMED (deflateInit2 (&replay->strm, init->level, init->zmethod,
+                               init->window_bits, init->mem_level,
+                               init->strategy));
+  else if (init->method == '1')
+    err = TIMED (inflateInit (&replay->strm));
+  else
+    err = TIMED (inflateInit2 (&replay->strm, init->window_bits));
+  return err == Z_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void *
+align_up (void *p, int size)
+{
+  return (void *)(((uintptr_t)p + size - 1) & ~(size - 1));
+}
+
+static void *
+align_up_with_offset (void *p, int size, int offset)
+{
+  return (char *)align_up ((char *)p - offset, size) + offset;
+}
+
+/*
+ * Get count bytes at the same page offset as the recorded pointer, so that
+ * zlib sees the same alignment as during recording.
+ */
+static void *
+replay_buffer_get (struct replay_buffer *buf, size_t count, uint64_t recorded,
+                   const char *argv0)
+{
+  void *data;
+
+  if (count + PAGE_SIZE > buf->size)
     {
-      if (fscanf (replay->mfp, "%i", &level) != 1)
+      data = realloc (buf->data, count + PAGE_SIZE);
+      if (!data)
         {
-          fprintf (stderr, "%s: could not read deflateInit arguments\n",
-                   argv0);
-          return EXIT_FAILURE;
+          fprintf (stderr, "%s: oom\n", argv0);
+          return NULL;
         }
-      err = deflateInit (&replay->strm, level);
+      buf->data = data;
+      buf->size = count + PAGE_SIZE;
+    }
+  return align_up_with_offset (buf->data, PAGE_SIZE,
+                               (int)(recorded & PAGE_OFFSET_MASK));
+}
+
+/*
+ * Reserve address space for a huge buffer.  Only the pages that are touched
+ * take memory.
+ */
+static void *
+reserve (size_t size, const char *argv0)
+{
+  void *p;
+
+  p = mmap (NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      fprintf (stderr, "%s: could not reserve %zu bytes\n", argv0, size);
+      return NULL;
     }
-  else if (replay->kind == 'd' && init_method[0] == '2')
+  return p;
+}
+
+static int
+call_one (struct replay_state *replay, const struct trace_call *call,
+          const char **func)
+{
+  int z_err;
+
+  switch (call->kind)
     {
-      if (fscanf (replay->mfp, "%i %i %i %i %i", &level, &method, &window_bits,
-                  &mem_level, &strategy)
-          != 5)
+    case 'p':
+      *func = "deflateParams";
+      z_err = TIMED (
+          deflateParams (&replay->strm, call->level, call->strategy));
+      if (z_err == Z_OK)
         {
-          fprintf (stderr, "%s: could not read deflateInit2 arguments\n",
-                   argv0);
-          return EXIT_FAILURE;
+          replay->level = call->level;
+          replay->strategy = call->strategy;
         }
-      err = deflateInit2 (&replay->strm, level, method, window_bits, mem_level,
-                          strategy);
+      return z_err;
+    case 'c':
+      *func = stream_kind (replay->kind);
+      return replay->kind == 'd'
+                 ? TIMED (deflate (&replay->strm, call->flush))
+                 : TIMED (inflate (&replay->strm, call->flush));
+    default:
+      *func = replay->kind == 'd' ? "deflateReset" : "inflateReset";
+      return replay->kind == 'd' ? TIMED (deflateReset (&replay->strm))
+                                 : TIMED (inflateReset (&replay->strm));
     }
-  else if (replay->kind == 'd' && init_method[0] == 'c')
+}
+
+static int
+check_one (struct replay_state *replay, const struct trace_call *call,
+           const char *func, int z_err, unsigned int consumed_in,
+           unsigned int consumed_out, int data_ok, const char *argv0)
+{
+  if (z_err != call->err)
+    fprintf (stderr,
+             "%s: %s return value mismatch (actual: %i, expected: %i)\n",
+             argv0, func, z_err, call->err);
+  else if (consumed_in != call->consumed_in)
+    fprintf (stderr, "%s: consumed_in mismatch (actual: %u, expected: %u)\n",
+             argv0, consumed_in, call->consumed_in);
+  else if (consumed_out != call->consumed_out)
+    fprintf (stderr, "%s: consumed_out mismatch (actual: %u expected:%u)\n",
+             argv0, consumed_out, call->consumed_out);
+  else if (!data_ok)
+    fprintf (stderr, "%s: %scompressed data mismatch\n", argv0,
+             replay->kind == 'd' ? "" : "un");
+  else
+    return EXIT_SUCCESS;
+  return EXIT_FAILURE;
+}
+
+/*
+ * Point the stream at the input window of a huge call that starts at offset
+ * given.  Windows that the trace has in full are used in place; the rest is
+ * copied, padded with zeros where the trace has no input.
+ */
+static int
+next_window (struct replay_state *replay, const struct trace_call *call,
+             uInt given, int *in_place, const char *argv0)
+{
+  uInt window = call->avail_in - given;
+  size_t copied = 0;
+  Bytef *next_in;
+
+  if (window > piece_size)
+    window = piece_size;
+  *in_place = call->avail_in > piece_size
+              && (size_t)given + window <= call->in.len;
+  if (*in_place)
+    next_in = (Bytef *)call->in.data + given;
+  else
     {
-      if (replay_copy (replay, &err, argv0) != EXIT_SUCCESS)
+      next_in = replay_buffer_get (&replay->in_buf, window,
+                                   call->next_in + given, argv0);
+      if (!next_in)
         return EXIT_FAILURE;
+      if (given < call->in.len)
+        copied = call->in.len - given;
+      memcpy (next_in, call->in.data + given, copied);
+      memset (next_in + copied, 0, window - copied);
     }
-  else if (replay->kind == 'i' && init_method[0] == '1')
+  replay->strm.next_in = next_in;
+  replay->strm.avail_in = window;
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Replay a call with huge buffers.  Input is fed in piece_size windows and
+ * output is produced piece by piece into a piece_size buffer and checked
+ * against the trace as it goes: the same call split this way behaves
+ * identically, except for stored blocks, whose size depends on the buffer
+ * space, and deflateParams and xxxReset, which are not split.  Those get
+ * reserved address space instead.  Deflate sees Z_NO_FLUSH until the last
+ * input window, and inflate with Z_FINISH is split into Z_NO_FLUSH calls,
+ * which makes it keep a window.
+ */
+static int
+replay_huge (struct replay_state *replay, const struct trace_call *call,
+             const char *argv0)
+{
+  struct trace_call piece_call = *call;
+  const char *func;
+  Bytef *in_map = NULL;
+  Bytef *out_map = NULL;
+  Bytef *window = NULL;
+  Bytef *next_out;
+  uInt given = 0;
+  uInt produced = 0;
+  uInt piece;
+  uInt avail_in;
+  uInt n;
+  int in_place = 0;
+  int data_ok = 1;
+  int split;
+  int refill;
+  int z_err;
+  int ret = EXIT_FAILURE;
+
+  split = call->kind == 'c' && !(replay->kind == 'd' && replay->level == 0);
+  if (!split)
     {
-      err = inflateInit (&replay->strm);
+      if (call->avail_in <= piece_size)
+        window = replay_buffer_get (&replay->in_buf, call->avail_in,
+                                    call->next_in, argv0);
+      else if (call->in.len == call->avail_in)
+        window = (Bytef *)call->in.data;
+      else
+        window = in_map = reserve (call->avail_in, argv0);
+      if (!window)
+        return EXIT_FAILURE;
+      in_place = window == call->in.data;
+      if (!in_place)
+        memcpy (window, call->in.data, call->in.len);
+      replay->strm.next_in = window;
+      replay->strm.avail_in = given = call->avail_in;
     }
-  else if (replay->kind == 'i' && init_method[0] == '2')
+  if (split || call->avail_out <= piece_size)
+    next_out = replay_buffer_get (&replay->out_buf,
+                                  split && call->avail_out > piece_size
+                                      ? piece_size
+                                      : call->avail_out,
+                                  call->next_out, argv0);
+  else
+    next_out = out_map = reserve (call->avail_out, argv0);
+  if (!next_out)
+    goto unmap;
+  if (split && replay->kind == 'i' && call->flush == Z_FINISH)
+    piece_call.flush = Z_NO_FLUSH;
+  refill = split;
+  do
     {
-      if (fscanf (replay->mfp, "%i", &window_bits) != 1)
+      if (refill)
         {
-          fprintf (stderr, "%s: could not read inflateInit2 argument\n",
-                   argv0);
-          return EXIT_FAILURE;
+          if (next_window (replay, call, given, &in_place, argv0)
+              != EXIT_SUCCESS)
+            goto unmap;
+          window = replay->strm.next_in;
+          given += replay->strm.avail_in;
+          if (replay->kind == 'd')
+            piece_call.flush
+                = given < call->avail_in ? Z_NO_FLUSH : call->flush;
         }
-      err = inflateInit2 (&replay->strm, window_bits);
+      piece = call->avail_out - produced;
+      if (split && piece > piece_size)
+        piece = piece_size;
+      replay->strm.next_out = next_out;
+      replay->strm.avail_out = piece;
+      avail_in = replay->strm.avail_in;
+      z_err = call_one (replay, &piece_call, &func);
+      n = piece - replay->strm.avail_out;
+      /* The unsplit call would have returned after the previous piece. */
+      if (produced && z_err == Z_BUF_ERROR && n == 0
+          && avail_in == replay->strm.avail_in)
+        z_err = Z_OK;
+      if (n > call->consumed_out - produced
+          || memcmp (next_out, call->out.data + produced, n) != 0)
+        data_ok = 0;
+      else
+        trace_release (call->out.data + produced, n);
+      if (in_place)
+        trace_release (window, replay->strm.next_in - window);
+      produced += n;
+      refill = split && replay->strm.avail_in == 0 && given < call->avail_in;
     }
-  else if (replay->kind == 'i' && init_method[0] == 'c')
+  while (split && data_ok && z_err == Z_OK && produced < call->avail_out
+         && (replay->strm.avail_out == 0
+             || (replay->strm.avail_in == 0 && given < call->avail_in)));
+  if (replay->kind == 'i' && piece_call.flush != call->flush
+      && z_err == Z_OK)
+    z_err = Z_BUF_ERROR;
+  ret = check_one (replay, call, func, z_err,
+                   given - replay->strm.avail_in, produced, data_ok, argv0);
+unmap:
+  if (out_map)
+    munmap (out_map, call->avail_out ? call->avail_out : 1);
+  if (in_map)
+    munmap (in_map, call->avail_in ? call->avail_in : 1);
+  return ret;
+}
+
+static int
+replay_one (struct replay_state *replay, int *eof, const char *argv0)
+{
+  struct trace_record record;
+  const struct trace_call *call = &record.call;
+  const char *func;
+  int z_err;
+  unsigned int consumed_out;
+  Bytef *next_in;
+  Bytef *next_out;
+
+  if (trace_next (&replay->trace, &record, eof) != EXIT_SUCCESS)
     {
-      if (replay_copy (replay, &err, argv0) != EXIT_SUCCESS)
-        return EXIT_FAILURE;
+      fprintf (stderr, "%s: %s\n", argv0, replay->trace.error);
+      return EXIT_FAILURE;
     }
-  else
+  if (*eof)
+    return EXIT_SUCCESS;
+  if (record.type == TRACE_MEM)
     {
-      fprintf (stderr, "%s: unsupported stream kind and init method\n", argv0);
-      err = Z_STREAM_ERROR;
+      replay->recorded_mem.allocs = record.mem.allocs;
+      replay->recorded_mem.bytes = record.mem.bytes;
+      replay->recorded_mem.peak = record.mem.peak;
+      return EXIT_SUCCESS;
     }
-  return err == Z_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+  if (record.type == TRACE_TIME)
+    return EXIT_SUCCESS;
+  if (record.type == TRACE_CUT)
+    {
+      replay->cut = 1;
+      return EXIT_SUCCESS;
+    }
+  if (call->avail_in > piece_size || call->avail_out > piece_size)
+    return replay_huge (replay, call, argv0);
+  next_in = replay_buffer_get (&replay->in_buf, call->avail_in, call->next_in,
+                               argv0);
+  next_out = replay_buffer_get (&replay->out_buf, call->avail_out,
+                                call->next_out, argv0);
+  if (!next_in || !next_out)
+    return EXIT_FAILURE;
+  memcpy (next_in, call->in.data, call->in.len);
+  replay->strm.next_in = next_in;
+  replay->strm.avail_in = call->avail_in;
+  replay->strm.next_out = next_out;
+  replay->strm.avail_out = call->avail_out;
+  z_err = call_one (replay, call, &func);
+  consumed_out = call->avail_out - replay->strm.avail_out;
+  return check_one (replay, call, func, z_err,
+                    call->avail_in - replay->strm.avail_in, consumed_out,
+                    consumed_out == call->consumed_out
+                        && memcmp (next_out, call->out.data, consumed_out)
+                               == 0,
+                    argv0);
 }
 
-static void *
-align_up (void *p, int size)
+static int
+replay_open (struct replay_state *replay, const char *path, const char *argv0)
 {
-  return (void *)(((uintptr_t)p + size - 1) & ~(size - 1));
+  memset (&replay->in_buf, 0, sizeof (replay->in_buf));
+  memset (&replay->out_buf, 0, sizeof (replay->out_buf));
+  replay->cut = 0;
+  if (trace_open (&replay->trace, path) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: %s\n", argv0, replay->trace.error);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
 }
 
-static void *
-align_up_with_offset (void *p, int size, int offset)
+static void
+replay_close (struct replay_state *replay)
 {
-  return (char *)align_up ((char *)p - offset, size) + offset;
+  free (replay->out_buf.data);
+  free (replay->in_buf.data);
+  trace_close (&replay->trace);
 }
 
-static ssize_t
-fread_all (void *buf, size_t count, FILE *stream)
+/* Replay the calls of an open trace that come before end_off. */
+static int
+replay_calls (struct replay_state *replay, uint64_t end_off,
+              const char *argv0)
 {
-  ssize_t ret;
-  size_t n = count;
+  int eof = 0;
 
-  while (n)
+  while (!eof)
     {
-      ret = fread (buf, 1, n, stream);
-      if (ret == 0)
+      if (trace_offset (&replay->trace) >= end_off)
+        break;
+      if (replay_one (replay, &eof, argv0) != EXIT_SUCCESS)
         {
-          if (feof (stream))
-            break;
-          else
-            return -1;
+          fprintf (stderr,
+                   "%s: %s failed at offset "
+                   "uncompressed:%lu compressed:%lu\n",
+                   argv0, stream_kind (replay->kind), replay->strm.total_in,
+                   replay->strm.total_out);
+          return EXIT_FAILURE;
         }
-      buf = (char *)buf + ret;
-      n -= ret;
     }
-  return count - n;
+  return EXIT_SUCCESS;
 }
 
 static int
-replay_one (struct replay_state *replay, int *eof, const char *argv0)
+replay_run (struct replay_state *replay, const char *path, uint64_t end_off,
+            const char *argv0)
 {
-  char call_kind[2];
-  unsigned long next_in;
-  unsigned int avail_in;
-  unsigned long next_out;
-  unsigned int avail_out;
-  const char *func;
-  int level;
-  int strategy;
-  int flush;
-  unsigned int exp_consumed_in;
-  unsigned int exp_consumed_out;
-  int exp_err;
-  long fseek_offset;
-  void *buf;
-  void *exp_buf;
-  ssize_t valid_in;
-  ssize_t valid_out;
-  int err;
-  int z_err;
-  unsigned int consumed_in;
-  unsigned int consumed_out;
-  Bytef *actual_out;
   int ret = EXIT_FAILURE;
 
-  err = fscanf (replay->mfp, "%1s", call_kind);
-  if (err == EOF)
+  if (replay_open (replay, path, argv0) != EXIT_SUCCESS)
     {
-      *eof = 1;
-      return EXIT_SUCCESS;
+      fprintf (stderr, "%s: open failed\n", argv0);
+      goto done;
     }
-  if (err != 1)
+  if (replay_init (replay, argv0) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: init failed\n", argv0);
+      goto close_replay;
+    }
+  if (replay_calls (replay, end_off, argv0) != EXIT_SUCCESS)
+    goto close_replay;
+  ret = EXIT_SUCCESS;
+close_replay:
+  replay_close (replay);
+done:
+  return ret;
+}
+
+static int
+replay_end (struct replay_state *replay)
+{
+  return replay->kind == 'd' ? TIMED (deflateEnd (&replay->strm))
+                             : TIMED (inflateEnd (&replay->strm));
+}
+
+/*
+ * A trace may stop before its stream does, e.g. at the end of a capture; the
+ * recorder marks such traces.  deflateEnd () then reports the discarded
+ * data, but frees the stream.
+ */
+static int
+replay_end_checked (struct replay_state *replay, const char *path,
+                    const char *argv0)
+{
+  int err;
+
+  err = replay_end (replay);
+  if (err != Z_OK && !(err == Z_DATA_ERROR && replay->cut))
     {
-      fprintf (stderr, "%s: could not read call kind\n", argv0);
+      fprintf (stderr, "%s: %sEnd %s failed\n", argv0,
+               stream_kind (replay->kind), path);
       return EXIT_FAILURE;
     }
-  switch (call_kind[0])
+  return EXIT_SUCCESS;
+}
+
+/* Replace the window size in window_bits, keeping the wrapper kind. */
+static int
+with_window_size (int window_bits, int size)
+{
+  if (window_bits < 0)
+    return -size;
+  return window_bits - (window_bits & 15) + size;
+}
+
+/*
+ * Peak footprint of a stream with the given parameters.  Deflate allocates
+ * everything up front.  Inflate allocates its window when it has to return
+ * in the middle of a stream, so it is fed a small stream that is produced on
+ * the fly, with not enough room for all of its output.
+ */
+static unsigned long
+probe_peak (char kind, int level, int window_bits, int mem_level,
+            int strategy)
+{
+  static Bytef in[256];
+  Bytef compressed[512];
+  Bytef out[sizeof (in) / 4];
+  z_stream strm;
+  struct mem_stats mem;
+  uInt compressed_len;
+  int deflate_bits;
+
+  deflate_bits = window_bits;
+  if (kind == 'i')
     {
-    case 'p':
-      func = "deflateParams";
-      err = fscanf (replay->mfp, "%i %i", &level, &strategy);
-      if (err != 2)
+      if (window_bits > 31) /* automatic header detection */
+        deflate_bits = window_bits & 15;
+      if ((window_bits & 15) == 0) /* use the size from the zlib header */
+        deflate_bits = with_window_size (deflate_bits, 15);
+      level = Z_DEFAULT_COMPRESSION;
+      mem_level = 8;
+      strategy = Z_DEFAULT_STRATEGY;
+    }
+  memset (&strm, 0, sizeof (strm));
+  mem_init (&strm, &mem);
+  if (deflateInit2 (&strm, level, Z_DEFLATED, deflate_bits, mem_level,
+                    strategy)
+      != Z_OK)
+    return 0;
+  strm.next_in = in;
+  strm.avail_in = sizeof (in);
+  strm.next_out = compressed;
+  strm.avail_out = sizeof (compressed);
+  deflate (&strm, Z_FINISH);
+  compressed_len = sizeof (compressed) - strm.avail_out;
+  deflateEnd (&strm);
+  if (kind == 'd')
+    return mem.peak;
+
+  memset (&strm, 0, sizeof (strm));
+  mem_init (&strm, &mem);
+  if (inflateInit2 (&strm, window_bits) != Z_OK)
+    return 0;
+  strm.next_in = compressed;
+  strm.avail_in = compressed_len;
+  strm.next_out = out;
+  strm.avail_out = sizeof (out);
+  inflate (&strm, Z_NO_FLUSH);
+  inflateEnd (&strm);
+  return mem.peak;
+}
+
+static void
+print_mem_report (struct replay_state *replay)
+{
+  int min_bits = replay->kind == 'd' ? 9 : 8;
+  int bits = replay->window_bits < 0 ? -replay->window_bits
+                                     : replay->window_bits & 15;
+  unsigned long peak;
+  int window_bits;
+  int mem_level;
+
+  printf ("recorded: %lu allocs, %lu bytes, peak %lu bytes\n",
+          replay->recorded_mem.allocs, replay->recorded_mem.bytes,
+          replay->recorded_mem.peak);
+  printf ("replayed: %lu allocs, %lu bytes, peak %lu bytes\n",
+          replay->mem.allocs, replay->mem.bytes, replay->mem.peak);
+  if (replay->mem.peak)
+    printf ("streams per GiB: %lu\n", (1UL << 30) / replay->mem.peak);
+  printf ("peak KiB per stream (* recorded parameters)\n");
+  printf ("windowBits");
+  if (replay->kind == 'd')
+    {
+      printf (" memLevel:");
+      for (mem_level = 1; mem_level <= 9; mem_level++)
+        printf ("%7d", mem_level);
+    }
+  printf ("\n");
+  for (window_bits = min_bits; window_bits <= 15; window_bits++)
+    {
+      printf ("%10d", window_bits);
+      if (replay->kind == 'd')
+        printf ("          ");
+      for (mem_level = 1; mem_level <= (replay->kind == 'd' ? 9 : 1);
+           mem_level++)
         {
-          fprintf (stderr, "%s: could not read %s arguments\n", argv0, func);
-          return EXIT_FAILURE;
+          peak = probe_peak (
+              replay->kind, replay->level,
+              with_window_size (replay->window_bits, window_bits),
+              replay->kind == 'd' ? mem_level : replay->mem_level,
+              replay->strategy);
+          printf ("%6lu%c", (peak + 1023) / 1024,
+                  window_bits == bits
+                          && (replay->kind == 'i'
+                              || mem_level == replay->mem_level)
+                      ? '*'
+                      : ' ');
         }
-      break;
-    case 'c':
-      func = stream_kind (replay->kind);
-      err = fscanf (replay->mfp, "%i", &flush);
-      if (err != 1)
+      printf ("\n");
+    }
+}
+
+static void
+usage (const char *argv0)
+{
+  fprintf (stderr,
+           "Usage: %s [-m] [-a ALLOCATOR] [-A] [-n COUNT] [-b PIECE_SIZE] [-t] "
+           "{deflate | inflate}.PID.STREAM ...\n"
+           "       %s -P [-j THREADS] [-s CHUNK_SIZE] [-D] "
+           "deflate.PID.STREAM ...\n"
+           "       %s -T [-x SPEED] {deflate | inflate}.PID.STREAM ...\n"
+           "       %s -d LIB -d LIB [-k INTERVAL] "
+           "{deflate | inflate}.PID.STREAM ...\n"
+           "       %s -p [-n COUNT] {TRACE | DIRECTORY} ...\n"
+           "ALLOCATOR is one of: default, pool, hugepage\n",
+           argv0, argv0, argv0, argv0, argv0);
+}
+
+/* Per-trace totals for -t. */
+struct replay_timing
+{
+  uint64_t bytes;
+  uint64_t zlib_ns;
+  uint64_t replay_ns;
+};
+
+static int
+replay_file (const char *path, int mem_report, struct replay_timing *timing,
+             const char *argv0)
+{
+  struct replay_state replay;
+  uint64_t start_zlib_ns = zlib_ns;
+  uint64_t start_ns = now_ns ();
+
+  if (replay_run (&replay, path, UINT64_MAX, argv0) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: run %s failed\n", argv0, path);
+      return EXIT_FAILURE;
+    }
+  if (timing)
+    {
+      timing->bytes
+          += replay.kind == 'd' ? replay.strm.total_in : replay.strm.total_out;
+      timing->zlib_ns += zlib_ns - start_zlib_ns;
+      timing->replay_ns += now_ns () - start_ns;
+    }
+  if (mem_report)
+    print_mem_report (&replay);
+  return replay_end_checked (&replay, path, argv0);
+}
+
+/* Replay all traces once with allocator, adding the time spent in zlib. */
+static int
+replay_with_allocator (char **paths, int n_paths, enum mem_allocator allocator,
+                       uint64_t *ns, const char *argv0)
+{
+  int i;
+
+  mem_set_allocator (allocator);
+  zlib_ns = 0;
+  for (i = 0; i < n_paths; i++)
+    if (replay_file (paths[i], 0, NULL, argv0) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+  if (ns)
+    *ns += zlib_ns;
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Replay all traces COUNT times with each allocator and compare the time
+ * spent in zlib, which includes the time spent in zalloc and zfree.  A
+ * discarded warm-up round comes first, and the order of the allocators
+ * alternates between rounds, so that none of them always runs first.
+ */
+static int
+compare_allocators (char **paths, int n_paths, int count, const char *argv0)
+{
+  uint64_t ns[MEM_ALLOCATORS];
+  unsigned long streams = (unsigned long)n_paths * count;
+  int allocator;
+  int ret = EXIT_FAILURE;
+  int i;
+  int j;
+
+  memset (ns, 0, sizeof (ns));
+  for (j = 0; j < MEM_ALLOCATORS; j++)
+    if (replay_with_allocator (paths, n_paths, j, NULL, argv0)
+        != EXIT_SUCCESS)
+      goto done;
+  for (i = 0; i < count; i++)
+    for (j = 0; j < MEM_ALLOCATORS; j++)
+      {
+        allocator = i % 2 ? MEM_ALLOCATORS - 1 - j : j;
+        if (replay_with_allocator (paths, n_paths, allocator,
+                                   &ns[allocator], argv0)
+            != EXIT_SUCCESS)
+          goto done;
+      }
+  printf ("%-10s %10s %14s %16s %10s\n", "allocator", "streams",
+          "zlib time, s", "per stream, us", "vs default");
+  for (allocator = 0; allocator < MEM_ALLOCATORS; allocator++)
+    printf ("%-10s %10lu %14.6f %16.3f %+9.1f%%\n",
+            mem_allocator_name (allocator), streams, ns[allocator] / 1e9,
+            ns[allocator] / 1e3 / streams,
+            ns[MEM_DEFAULT] ? 100.0 * ns[allocator] / ns[MEM_DEFAULT] - 100
+                            : 0.);
+  ret = EXIT_SUCCESS;
+done:
+  mem_set_allocator (MEM_DEFAULT);
+  return ret;
+}
+
+/* When a stream was in use, for -p. */
+struct pool_span
+{
+  uint64_t pid;
+  uint64_t start_ns;
+  uint64_t end_ns;
+};
+
+/* Traces with the same init line, which one pooled stream can serve. */
+struct pool_group
+{
+  struct trace_init init;
+  char **paths;
+  size_t n_paths;
+  size_t cap;
+  struct pool_span *spans;
+  size_t n_spans;
+};
+
+struct pool_result
+{
+  uint64_t zlib_ns;
+  uint64_t replay_ns;
+  unsigned long allocs;
+  unsigned long bytes;
+};
+
+/* {deflate | inflate}.PID.STREAM, but not its payloads. */
+static int
+is_trace_name (const struct dirent *entry)
+{
+  const char *s = entry->d_name;
+  int i;
+
+  if (strncmp (s, "deflate.", 8) != 0 && strncmp (s, "inflate.", 8) != 0)
+    return 0;
+  s += 8;
+  for (i = 0; i < 2; i++)
+    {
+      if (!isdigit ((unsigned char)*s))
+        return 0;
+      while (isdigit ((unsigned char)*s))
+        s++;
+      if (*s++ != (i == 0 ? '.' : '\0'))
+        return 0;
+    }
+  return 1;
+}
+
+static uint64_t
+trace_pid (const char *path)
+{
+  const char *name = strrchr (path, '/');
+
+  name = name ? name + 1 : path;
+  return strchr (name, '.') ? strtoull (strchr (name, '.') + 1, NULL, 10)
+                            : 0;
+}
+
+static int
+same_init (const struct trace_init *x, const struct trace_init *y)
+{
+  return x->kind == y->kind && x->level == y->level
+         && x->zmethod == y->zmethod && x->window_bits == y->window_bits
+         && x->mem_level == y->mem_level && x->strategy == y->strategy;
+}
+
+/* The span of the stream from the first call to the end of the last one. */
+static int
+scan_span (struct trace *trace, struct pool_span *span, const char *argv0)
+{
+  struct trace_record record;
+  int eof = 0;
+
+  span->start_ns = UINT64_MAX;
+  span->end_ns = 0;
+  for (;;)
+    {
+      if (trace_next (trace, &record, &eof) != EXIT_SUCCESS)
         {
-          fprintf (stderr, "%s: could not read %s arguments\n", argv0, func);
+          fprintf (stderr, "%s: %s\n", argv0, trace->error);
           return EXIT_FAILURE;
         }
+      if (eof)
+        return EXIT_SUCCESS;
+      if (record.type != TRACE_TIME)
+        continue;
+      if (record.time.start_ns < span->start_ns)
+        span->start_ns = record.time.start_ns;
+      if (record.time.start_ns + record.time.duration_ns > span->end_ns)
+        span->end_ns = record.time.start_ns + record.time.duration_ns;
+    }
+}
+
+static int
+add_trace (struct pool_group **groups, size_t *n_groups, char *path,
+           const char *argv0)
+{
+  struct trace trace;
+  struct pool_group *group;
+  struct pool_span span;
+  void *p;
+  size_t i;
+  int ret = EXIT_FAILURE;
+
+  if (trace_open (&trace, path) != EXIT_SUCCESS)
+    {
+      fprintf (stderr, "%s: %s\n", argv0, trace.error);
+      goto free_path;
+    }
+  if (trace.init.method == 'c')
+    {
+      /* A pool resets streams; it does not hand out copies. */
+      fprintf (stderr, "%s: skipping %s: copies are not supported\n", argv0,
+               path);
+      ret = EXIT_SUCCESS;
+      goto close_trace;
+    }
+  span.pid = trace_pid (path);
+  if (scan_span (&trace, &span, argv0) != EXIT_SUCCESS)
+    goto close_trace;
+  for (i = 0; i < *n_groups; i++)
+    if (same_init (&(*groups)[i].init, &trace.init))
       break;
-    case 'r':
-      func = replay->kind == 'd' ? "deflateReset" : "inflateReset";
-      break;
-    default:
-      fprintf (stderr, "%s: unsupported call kind\n", argv0);
-      return EXIT_FAILURE;
+  if (i == *n_groups)
+    {
+      p = realloc (*groups, (i + 1) * sizeof (**groups));
+      if (!p)
+        goto oom;
+      *groups = p;
+      memset (&(*groups)[i], 0, sizeof (**groups));
+      (*groups)[i].init = trace.init;
+      (*n_groups)++;
     }
-  err = fscanf (replay->mfp, "%lx %u %lx %u", &next_in, &avail_in, &next_out,
-                &avail_out);
-  if (err != 4)
+  group = &(*groups)[i];
+  if (group->n_paths == group->cap)
     {
-      fprintf (stderr, "%s: could not read stream pointers\n", argv0);
-      return EXIT_FAILURE;
+      group->cap = group->cap ? group->cap * 2 : 64;
+      p = realloc (group->paths, group->cap * sizeof (*group->paths));
+      if (!p)
+        goto oom;
+      group->paths = p;
+      p = realloc (group->spans, group->cap * sizeof (*group->spans));
+      if (!p)
+        goto oom;
+      group->spans = p;
+    }
+  group->paths[group->n_paths++] = path;
+  path = NULL;
+  if (span.start_ns <= span.end_ns)
+    group->spans[group->n_spans++] = span;
+  ret = EXIT_SUCCESS;
+  goto close_trace;
+oom:
+  fprintf (stderr, "%s: oom\n", argv0);
+close_trace:
+  trace_close (&trace);
+free_path:
+  free (path);
+  return ret;
+}
+
+/* Add a trace, or the traces in a directory in name order. */
+static int
+add_path (struct pool_group **groups, size_t *n_groups, const char *path,
+          const char *argv0)
+{
+  struct dirent **entries;
+  struct stat st;
+  char *trace_path;
+  int n;
+  int i;
+  int ret = EXIT_SUCCESS;
+
+  if (stat (path, &st) != 0 || !S_ISDIR (st.st_mode))
+    {
+      trace_path = strdup (path);
+      if (!trace_path)
+        {
+          fprintf (stderr, "%s: oom\n", argv0);
+          return EXIT_FAILURE;
+        }
+      return add_trace (groups, n_groups, trace_path, argv0);
     }
-  buf = malloc (avail_in + PAGE_SIZE + avail_out + PAGE_SIZE + avail_out);
-  if (!buf)
+  n = scandir (path, &entries, is_trace_name, alphasort);
+  if (n < 0)
     {
-      fprintf (stderr, "%s: oom\n", argv0);
+      fprintf (stderr, "%s: scandir %s failed\n", argv0, path);
       return EXIT_FAILURE;
     }
-  replay->strm.next_in
-      = align_up_with_offset (buf, PAGE_SIZE, (int)next_in & PAGE_OFFSET_MASK);
-  replay->strm.avail_in = avail_in;
-  replay->strm.next_out
-      = align_up_with_offset (replay->strm.next_in + avail_in, PAGE_SIZE,
-                              (int)next_out & PAGE_OFFSET_MASK);
-  replay->strm.avail_out = avail_out;
-  exp_buf = replay->strm.next_out + avail_out;
-  valid_in = fread_all (replay->strm.next_in, avail_in, replay->ifp);
-  if (valid_in == -1)
+  for (i = 0; i < n; i++)
     {
-      fprintf (stderr, "%s: could not read %u bytes from the input file\n",
-               argv0, avail_in);
-      goto free_buf;
+      if (ret == EXIT_SUCCESS)
+        {
+          trace_path = malloc (strlen (path) + strlen (entries[i]->d_name)
+                               + 2);
+          if (!trace_path)
+            {
+              fprintf (stderr, "%s: oom\n", argv0);
+              ret = EXIT_FAILURE;
+            }
+          else
+            {
+              sprintf (trace_path, "%s/%s", path, entries[i]->d_name);
+              ret = add_trace (groups, n_groups, trace_path, argv0);
+            }
+        }
+      free (entries[i]);
     }
-  valid_out = fread_all (exp_buf, avail_out, replay->ofp);
-  if (valid_out == -1)
+  free (entries);
+  return ret;
+}
+
+/* A stream of a process starting (+1) or ending (-1) at ns. */
+struct pool_event
+{
+  uint64_t pid;
+  uint64_t ns;
+  int delta;
+};
+
+static int
+compare_pool_events (const void *a, const void *b)
+{
+  const struct pool_event *x = a;
+  const struct pool_event *y = b;
+
+  if (x->pid != y->pid)
+    return x->pid < y->pid ? -1 : 1;
+  if (x->ns != y->ns)
+    return x->ns < y->ns ? -1 : 1;
+  /* At equal times, a stream ends before the next one starts. */
+  return x->delta - y->delta;
+}
+
+/*
+ * The number of streams of the group a process had in use at once, which is
+ * the size its pool would need, or 0 if the traces have no timing.
+ */
+static size_t
+pool_size (const struct pool_group *group, const char *argv0)
+{
+  struct pool_event *events;
+  size_t n = 2 * group->n_spans;
+  long live = 0;
+  long peak = 0;
+  size_t i;
+
+  if (n == 0)
+    return 0;
+  events = malloc (n * sizeof (*events));
+  if (!events)
     {
-      fprintf (stderr, "%s: could not read %u bytes from the output file\n",
-               argv0, avail_out);
-      goto free_buf;
+      fprintf (stderr, "%s: oom\n", argv0);
+      return 0;
     }
-  switch (call_kind[0])
+  for (i = 0; i < group->n_spans; i++)
     {
-    case 'p':
-      z_err = deflateParams (&replay->strm, level, strategy);
-      break;
-    case 'c':
-      z_err = replay->kind == 'd' ? deflate (&replay->strm, flush)
-                                  : inflate (&replay->strm, flush);
-      break;
-    case 'r':
-      z_err = replay->kind == 'd' ? deflateReset (&replay->strm)
-                                  : inflateReset (&replay->strm);
-      break;
+      events[2 * i].pid = group->spans[i].pid;
+      events[2 * i].ns = group->spans[i].start_ns;
+      events[2 * i].delta = 1;
+      events[2 * i + 1].pid = group->spans[i].pid;
+      events[2 * i + 1].ns = group->spans[i].end_ns;
+      events[2 * i + 1].delta = -1;
     }
-  err = fscanf (replay->mfp, "%u %u %i", &exp_consumed_in, &exp_consumed_out,
-                &exp_err);
-  if (err != 3)
+  qsort (events, n, sizeof (*events), compare_pool_events);
+  for (i = 0; i < n; i++)
     {
-      fprintf (stderr, "%s: could not read %s results\n", argv0, func);
-      return EXIT_FAILURE;
+      if (i > 0 && events[i].pid != events[i - 1].pid)
+        live = 0;
+      live += events[i].delta;
+      if (live > peak)
+        peak = live;
     }
-  fseek_offset = (long)(int)(exp_consumed_in - valid_in);
-  if (fseek (replay->ifp, fseek_offset, SEEK_CUR) == -1)
+  free (events);
+  return (size_t)peak;
+}
+
+/* Init, replay and end a stream per trace, as the application did. */
+static int
+replay_churn (const struct pool_group *group, struct pool_result *result,
+              const char *argv0)
+{
+  struct replay_state replay;
+  size_t i;
+
+  for (i = 0; i < group->n_paths; i++)
     {
-      fprintf (stderr, "%s: could not seek by %ld in the input file\n", argv0,
-               fseek_offset);
-      goto free_buf;
+      if (replay_run (&replay, group->paths[i], UINT64_MAX, argv0)
+          != EXIT_SUCCESS)
+        {
+          fprintf (stderr, "%s: run %s failed\n", argv0, group->paths[i]);
+          return EXIT_FAILURE;
+        }
+      if (replay_end_checked (&replay, group->paths[i], argv0)
+          != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+      result->allocs += replay.mem.allocs;
+      result->bytes += replay.mem.bytes;
     }
-  fseek_offset = (long)(int)(exp_consumed_out - valid_out);
-  if (fseek (replay->ofp, fseek_offset, SEEK_CUR) == -1)
+  return EXIT_SUCCESS;
+}
+
+/* Hand a stream that served a trace of the group to the next one. */
+static int
+replay_reset (struct replay_state *replay)
+{
+  const struct trace_init *init = &replay->trace.init;
+  int err;
+
+  if (replay->kind == 'i')
+    return TIMED (inflateReset (&replay->strm));
+  err = TIMED (deflateReset (&replay->strm));
+  /* deflateReset () keeps the parameters the previous user set. */
+  if (err == Z_OK
+      && (replay->level != init->level || replay->strategy != init->strategy))
     {
-      fprintf (stderr, "%s: could not seek by %ld in the output file\n", argv0,
-               fseek_offset);
-      goto free_buf;
+      err = TIMED (
+          deflateParams (&replay->strm, init->level, init->strategy));
+      replay->level = init->level;
+      replay->strategy = init->strategy;
     }
-  consumed_in = avail_in - replay->strm.avail_in;
-  consumed_out = avail_out - replay->strm.avail_out;
-  actual_out = replay->strm.next_out - consumed_out;
-  if (z_err != exp_err)
-    fprintf (stderr,
-             "%s: %s return value mismatch (actual: %i, expected: %i)\n",
-             argv0, func, z_err, exp_err);
-  else if (consumed_in != exp_consumed_in)
-    fprintf (stderr, "%s: consumed_in mismatch (actual: %u, expected: %u)\n",
-             argv0, consumed_in, exp_consumed_in);
-  else if (consumed_out != exp_consumed_out)
-    fprintf (stderr, "%s: consumed_out mismatch (actual: %u expected:%u)\n",
-             argv0, consumed_out, exp_consumed_out);
-  else if (memcmp (actual_out, exp_buf, consumed_out) != 0)
-    fprintf (stderr, "%s: %scompressed data mismatch\n", argv0,
-             replay->kind == 'd' ? "" : "un");
-  else
-    ret = EXIT_SUCCESS;
-free_buf:
-  free (buf);
-  return ret;
+  return err;
 }
 
+/* Replay all traces of the group on one stream, resetting it in between. */
 static int
-replay_open (struct replay_state *replay, const char *path, const char *argv0)
+replay_pooled (const struct pool_group *group, struct pool_result *result,
+               const char *argv0)
 {
-  char buf[256];
+  struct replay_state replay;
+  int have_stream = 0;
+  size_t i;
+  int ret = EXIT_FAILURE;
 
-  if (!(replay->mfp = fopen (path, "r")))
+  for (i = 0; i < group->n_paths; i++)
     {
-      fprintf (stderr, "%s: could not open %s\n", argv0, path);
-      goto fail;
+      if (replay_open (&replay, group->paths[i], argv0) != EXIT_SUCCESS)
+        goto done;
+      if (!have_stream && replay_init (&replay, argv0) != EXIT_SUCCESS)
+        {
+          fprintf (stderr, "%s: init %s failed\n", argv0, group->paths[i]);
+          replay_close (&replay);
+          goto done;
+        }
+      if (have_stream && replay_reset (&replay) != Z_OK)
+        {
+          fprintf (stderr, "%s: reset for %s failed\n", argv0,
+                   group->paths[i]);
+          replay_close (&replay);
+          goto done;
+        }
+      have_stream = 1;
+      if (replay_calls (&replay, UINT64_MAX, argv0) != EXIT_SUCCESS)
+        {
+          fprintf (stderr, "%s: run %s failed\n", argv0, group->paths[i]);
+          replay_close (&replay);
+          goto done;
+        }
+      replay_close (&replay);
     }
-  buf[snprintf (buf, sizeof (buf) - 1, "%s.in", path)] = 0;
-  if (!(replay->ifp = fopen (buf, "r")))
+  ret = EXIT_SUCCESS;
+done:
+  if (have_stream)
     {
-      fprintf (stderr, "%s: could not open %s\n", argv0, buf);
-      goto fail_close_mfp;
+      replay_end (&replay); /* ignore rc, see replay_end_checked () */
+      result->allocs = replay.mem.allocs;
+      result->bytes = replay.mem.bytes;
     }
-  buf[snprintf (buf, sizeof (buf) - 1, "%s.out", path)] = 0;
-  if (!(replay->ofp = fopen (buf, "r")))
+  return ret;
+}
+
+/* Run mode on the group COUNT times and keep the best times. */
+static int
+pool_measure (const struct pool_group *group,
+              int (*mode) (const struct pool_group *, struct pool_result *,
+                           const char *),
+              int count, struct pool_result *best, const char *argv0)
+{
+  struct pool_result result;
+  uint64_t start_ns;
+  int i;
+
+  memset (best, 0, sizeof (*best));
+  for (i = 0; i < count; i++)
     {
-      fprintf (stderr, "%s: could not open %s\n", argv0, buf);
-      goto fail_close_ifp;
+      memset (&result, 0, sizeof (result));
+      zlib_ns = 0;
+      start_ns = now_ns ();
+      if (mode (group, &result, argv0) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+      result.replay_ns = now_ns () - start_ns;
+      result.zlib_ns = zlib_ns;
+      if (i == 0 || result.replay_ns < best->replay_ns)
+        *best = result;
     }
   return EXIT_SUCCESS;
-fail_close_ifp:
-  fclose (replay->ifp);
-fail_close_mfp:
-  fclose (replay->mfp);
-fail:
-  return EXIT_FAILURE;
+}
+
+static double
+saving (double before, double after)
+{
+  return before ? 100. - 100. * after / before : 0.;
 }
 
 static void
-replay_close (struct replay_state *replay)
+print_pool_report (const struct pool_group *group, size_t size,
+                   const struct pool_result *churn,
+                   const struct pool_result *pooled)
 {
-  fclose (replay->ofp);
-  fclose (replay->ifp);
-  fclose (replay->mfp);
+  const struct trace_init *init = &group->init;
+
+  if (init->kind == 'd')
+    printf ("deflate level %i method %i windowBits %i memLevel %i "
+            "strategy %i",
+            init->level, init->zmethod, init->window_bits, init->mem_level,
+            init->strategy);
+  else
+    printf ("inflate windowBits %i", init->window_bits);
+  printf (": %zu stream%s", group->n_paths,
+          group->n_paths == 1 ? "" : "s");
+  if (size)
+    printf (", up to %zu at once in a process", size);
+  printf ("\n%-10s %14s %16s %12s %14s\n", "", "zlib time, s",
+          "replay time, s", "allocs", "bytes");
+  printf ("%-10s %14.6f %16.6f %12lu %14lu\n", "recorded",
+          churn->zlib_ns / 1e9, churn->replay_ns / 1e9, churn->allocs,
+          churn->bytes);
+  printf ("%-10s %14.6f %16.6f %12lu %14lu\n", "pooled",
+          pooled->zlib_ns / 1e9, pooled->replay_ns / 1e9, pooled->allocs,
+          pooled->bytes);
+  printf ("%-10s %13.1f%% %15.1f%% %11.1f%% %13.1f%%\n", "saved",
+          saving (churn->zlib_ns, pooled->zlib_ns),
+          saving (churn->replay_ns, pooled->replay_ns),
+          saving (churn->allocs, pooled->allocs),
+          saving (churn->bytes, pooled->bytes));
 }
 
+/*
+ * Replay the traces of each group of streams with the same parameters as
+ * recorded, and on a single stream that is reset between traces, and
+ * compare the time and the allocations.
+ */
 static int
-replay_run (struct replay_state *replay, const char *path,
-            unsigned long end_off, const char *argv0)
+compare_pooling (char **paths, int n_paths, int count, const char *argv0)
 {
-  int eof = 0;
-  unsigned long off;
+  struct pool_group *groups = NULL;
+  size_t n_groups = 0;
+  struct pool_result churn;
+  struct pool_result pooled;
+  size_t i;
+  size_t j;
   int ret = EXIT_FAILURE;
 
-  if (replay_open (replay, path, argv0) != EXIT_SUCCESS)
-    {
-      fprintf (stderr, "%s: open failed\n", argv0);
+  for (i = 0; i < (size_t)n_paths; i++)
+    if (add_path (&groups, &n_groups, paths[i], argv0) != EXIT_SUCCESS)
       goto done;
-    }
-  if (replay_init (replay, argv0) != EXIT_SUCCESS)
+  if (n_groups == 0)
     {
-      fprintf (stderr, "%s: init failed\n", argv0);
-      goto close_replay;
+      fprintf (stderr, "%s: no traces to replay\n", argv0);
+      goto done;
     }
-  while (!eof)
+  for (i = 0; i < n_groups; i++)
     {
-      off = (unsigned long)ftell (replay->mfp);
-      if (off == -1UL)
-        {
-          fprintf (stderr, "%s: ftell() failed\n", argv0);
-          goto close_replay;
-        }
-      if (off >= end_off)
-        break;
-      if (replay_one (replay, &eof, argv0) != EXIT_SUCCESS)
-        {
-          fprintf (stderr,
-                   "%s: %s failed at offset "
-                   "uncompressed:%lu compressed:%lu\n",
-                   argv0, stream_kind (replay->kind), replay->strm.total_in,
-                   replay->strm.total_out);
-          goto close_replay;
-        }
+      if (pool_measure (&groups[i], replay_churn, count, &churn, argv0)
+              != EXIT_SUCCESS
+          || pool_measure (&groups[i], replay_pooled, count, &pooled, argv0)
+                 != EXIT_SUCCESS)
+        goto done;
+      if (i > 0)
+        printf ("\n");
+      print_pool_report (&groups[i], pool_size (&groups[i], argv0), &churn,
+                         &pooled);
     }
   ret = EXIT_SUCCESS;
-close_replay:
-  replay_close (replay);
 done:
+  for (i = 0; i < n_groups; i++)
+    {
+      for (j = 0; j < groups[i].n_paths; j++)
+        free (groups[i].paths[j]);
+      free (groups[i].paths);
+      free (groups[i].spans);
+    }
+  free (groups);
   return ret;
 }
 
+static void
+print_json_string (const char *s)
+{
+  putchar ('"');
+  for (; *s; s++)
+    if (*s == '"' || *s == '\\')
+      printf ("\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      printf ("\\u%04x", *s);
+    else
+      putchar (*s);
+  putchar ('"');
+}
+
+/* Timing of each trace as JSON, for the benchmark harness. */
+static void
+print_timings (char **paths, int n_paths, const struct replay_timing *timings,
+               int count)
+{
+  int i;
+
+  printf ("[\n");
+  for (i = 0; i < n_paths; i++)
+    {
+      printf ("  {\"trace\": ");
+      print_json_string (paths[i]);
+      printf (", \"count\": %i, \"bytes\": %llu, \"zlib_ns\": %llu, "
+              "\"replay_ns\": %llu}%s\n",
+              count, (unsigned long long)timings[i].bytes,
+              (unsigned long long)timings[i].zlib_ns,
+              (unsigned long long)timings[i].replay_ns,
+              i == n_paths - 1 ? "" : ",");
+    }
+  printf ("]\n");
+}
+
+/* Parse a byte count with an optional K, M or G suffix. */
 static int
-replay_end (struct replay_state *replay)
+parse_size (const char *s, size_t *size)
 {
-  return replay->kind == 'd' ? deflateEnd (&replay->strm)
-                             : inflateEnd (&replay->strm);
+  char *end;
+  unsigned long long n;
+
+  n = strtoull (s, &end, 10);
+  switch (*end)
+    {
+    case 'G':
+      n <<= 10;
+      /* fallthrough */
+    case 'M':
+      n <<= 10;
+      /* fallthrough */
+    case 'K':
+      n <<= 10;
+      end++;
+      break;
+    }
+  if (end == s || *end || n == 0)
+    return -1;
+  *size = n;
+  return 0;
 }
 
 int
 main (int argc, char **argv)
 {
-  struct replay_state replay;
+  enum mem_allocator allocator = MEM_DEFAULT;
+  int mem_report = 0;
+  int compare = 0;
+  int pooling = 0;
+  int count = 1;
+  int parallel = 0;
+  int threads = (int)sysconf (_SC_NPROCESSORS_ONLN);
+  size_t chunk_size = 128 << 10;
+  int dictionary = 0;
+  int timeline = 0;
+  double speed = 1;
+  const char *libs[2];
+  int n_libs = 0;
+  int interval = 64;
+  struct replay_timing *timings = NULL;
+  int timing = 0;
+  char *end;
+  int opt;
+  int i;
   int ret = EXIT_FAILURE;
 
-  if (argc != 2)
+  while ((opt = getopt (argc, argv, "ma:Apn:b:tPj:s:DTx:d:k:")) != -1)
+    switch (opt)
+      {
+      case 'm':
+        mem_report = 1;
+        break;
+      case 'a':
+        if (mem_allocator_parse (optarg, &allocator) != 0)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        break;
+      case 'A':
+        compare = 1;
+        break;
+      case 'p':
+        pooling = 1;
+        break;
+      case 'n':
+        count = atoi (optarg);
+        if (count <= 0)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        break;
+      case 'b':
+        if (parse_size (optarg, &piece_size) != 0)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        break;
+      case 't':
+        timing = 1;
+        break;
+      case 'P':
+        parallel = 1;
+        break;
+      case 'j':
+        threads = atoi (optarg);
+        if (threads <= 0)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        break;
+      case 's':
+        if (parse_size (optarg, &chunk_size) != 0)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        break;
+      case 'D':
+        dictionary = 1;
+        break;
+      case 'T':
+        timeline = 1;
+        break;
+      case 'x':
+        speed = strtod (optarg, &end);
+        if (end == optarg || *end || speed < 0)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        break;
+      case 'd':
+        if (n_libs == 2)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        libs[n_libs++] = optarg;
+        break;
+      case 'k':
+        interval = atoi (optarg);
+        if (interval <= 0)
+          {
+            usage (argv[0]);
+            goto done;
+          }
+        break;
+      default:
+        usage (argv[0]);
+        goto done;
+      }
+  if (optind == argc || n_libs == 1)
+    {
+      usage (argv[0]);
+      goto done;
+    }
+  if (n_libs)
+    {
+      ret = bisect_run (argv + optind, argc - optind, libs[0], libs[1],
+                        interval, argv[0]);
+      goto done;
+    }
+  if (timeline)
     {
-      fprintf (stderr, "Usage: %s {deflate | inflate}.PID.STREAM\n", argv[0]);
+      ret = timeline_run (argv + optind, argc - optind, speed, argv[0]);
       goto done;
     }
-  if (replay_run (&replay, argv[1], -1UL, argv[0]) != EXIT_SUCCESS)
+  if (parallel)
     {
-      fprintf (stderr, "%s: run %s failed\n", argv[0], argv[1]);
+      for (opt = optind; opt < argc; opt++)
+        if (parallel_run (argv[opt], threads, chunk_size, dictionary, argv[0])
+            != EXIT_SUCCESS)
+          goto done;
+      ret = EXIT_SUCCESS;
       goto done;
     }
-  if (replay_end (&replay) != Z_OK)
+  if (pooling)
     {
-      fprintf (stderr, "%s: %sEnd %s failed\n", argv[0],
-               stream_kind (replay.kind), argv[1]);
+      ret = compare_pooling (argv + optind, argc - optind, count, argv[0]);
       goto done;
     }
+  if (compare)
+    {
+      ret = compare_allocators (argv + optind, argc - optind, count, argv[0]);
+      goto done;
+    }
+  if (timing)
+    {
+      timings = calloc (argc - optind, sizeof (*timings));
+      if (!timings)
+        {
+          fprintf (stderr, "%s: oom\n", argv[0]);
+          goto done;
+        }
+    }
+  mem_set_allocator (allocator);
+  for (i = 0; i < count; i++)
+    for (opt = optind; opt < argc; opt++)
+      {
+        if (mem_report && i == 0 && argc - optind > 1)
+          printf ("%s:\n", argv[opt]);
+        if (replay_file (argv[opt], mem_report && i == 0,
+                         timings ? &timings[opt - optind] : NULL, argv[0])
+            != EXIT_SUCCESS)
+          goto done;
+      }
+  if (timings)
+    print_timings (argv + optind, argc - optind, timings, count);
   ret = EXIT_SUCCESS;
 done:
+  free (timings);
   return ret;
 }
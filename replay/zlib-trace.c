@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "zlib-record-chunk.h"
+#include "zlib-trace.h"
+
+#define RELEASE_SIZE ((uint64_t)64 << 20)
+
+__attribute__ ((format (printf, 2, 3))) static int
+trace_fail (struct trace *trace, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start (args, fmt);
+  vsnprintf (trace->error, sizeof (trace->error), fmt, args);
+  va_end (args);
+  return EXIT_FAILURE;
+}
+
+/* Map fd, which is closed in any case. */
+static int
+map_fd (struct trace *trace, struct trace_file *file, int fd, const char *path)
+{
+  struct stat st;
+  void *data;
+
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return trace_fail (trace, "could not stat %s", path);
+    }
+  if ((uint64_t)st.st_size > SIZE_MAX)
+    {
+      close (fd);
+      return trace_fail (trace, "%s is too large to map", path);
+    }
+  file->len = (size_t)st.st_size;
+  file->data = NULL;
+  if (file->len)
+    {
+      data = mmap (NULL, file->len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+        {
+          close (fd);
+          return trace_fail (trace, "could not map %s", path);
+        }
+      madvise (data, file->len, MADV_SEQUENTIAL); /* ignore rc */
+      file->data = data;
+    }
+  close (fd);
+  return EXIT_SUCCESS;
+}
+
+static int
+map_file (struct trace *trace, struct trace_file *file, const char *path)
+{
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd == -1)
+    return trace_fail (trace, "could not open %s", path);
+  return map_fd (trace, file, fd, path);
+}
+
+static void
+unmap_file (struct trace_file *file)
+{
+  if (file->data)
+    munmap ((void *)file->data, file->len);
+  file->data = NULL;
+}
+
+/* Length of the directory part of path, including the trailing slash. */
+static size_t
+dir_len (const char *path)
+{
+  const char *slash = strrchr (path, '/');
+
+  return slash ? (size_t)(slash - path + 1) : 0;
+}
+
+static int
+copy_chunk (struct trace *trace, int fd, const char *store, uint64_t hash,
+            size_t len, Bytef *buf)
+{
+  char *path;
+  struct stat st;
+  ssize_t n;
+  size_t pos;
+  int chunk_fd;
+  int ret = EXIT_FAILURE;
+
+  path = malloc (strlen (store) + 32);
+  if (!path)
+    return trace_fail (trace, "oom");
+  sprintf (path, "%s/%02x/%016" PRIx64, store, (unsigned)(hash >> 56), hash);
+  chunk_fd = open (path, O_RDONLY);
+  if (chunk_fd == -1)
+    {
+      trace_fail (trace, "could not open %s", path);
+      goto out;
+    }
+  if (fstat (chunk_fd, &st) < 0 || (uint64_t)st.st_size != len)
+    {
+      trace_fail (trace, "%s does not have the expected size", path);
+      goto out_close;
+    }
+  for (pos = 0; pos < len; pos += n)
+    {
+      n = read (chunk_fd, buf + pos, len - pos);
+      if (n <= 0)
+        {
+          trace_fail (trace, "could not read %s", path);
+          goto out_close;
+        }
+    }
+  if (chunk_hash (buf, len) != hash)
+    {
+      trace_fail (trace, "%s is corrupt", path);
+      goto out_close;
+    }
+  for (pos = 0; pos < len; pos += n)
+    {
+      n = write (fd, buf + pos, len - pos);
+      if (n <= 0)
+        {
+          trace_fail (trace, "could not write the reassembled %s", path);
+          goto out_close;
+        }
+    }
+  ret = EXIT_SUCCESS;
+out_close:
+  close (chunk_fd);
+out:
+  free (path);
+  return ret;
+}
+
+/*
+ * Concatenate the chunks that a deduplicated payload index lists into an
+ * unlinked temporary file, and map that.
+ */
+static int
+assemble_file (struct trace *trace, struct trace_file *file,
+               const char *index_path)
+{
+  const char *tmpdir;
+  FILE *index;
+  char *line = NULL;
+  size_t line_size = 0;
+  char *store = NULL;
+  char *tmp = NULL;
+  Bytef *buf = NULL;
+  uint64_t hash;
+  size_t len;
+  ssize_t n;
+  size_t dir;
+  int fd = -1;
+  int ret;
+
+  index = fopen (index_path, "r");
+  if (!index)
+    return trace_fail (trace, "could not open %s", index_path);
+  n = getline (&line, &line_size, index);
+  if (n < 3 || strncmp (line, "s ", 2) != 0)
+    {
+      trace_fail (trace, "%s: could not read the chunk store", index_path);
+      goto fail;
+    }
+  if (line[n - 1] == '\n')
+    line[--n] = 0;
+  /* Like copy paths, relative stores are relative to the trace. */
+  dir = line[2] == '/' ? 0 : dir_len (index_path);
+  store = malloc (dir + n - 2 + 1);
+  tmpdir = getenv ("TMPDIR");
+  if (!tmpdir)
+    tmpdir = "/tmp";
+  tmp = malloc (strlen (tmpdir) + sizeof ("/zlib-trace.XXXXXX"));
+  buf = malloc (CHUNK_MAX_SIZE);
+  if (!store || !tmp || !buf)
+    {
+      trace_fail (trace, "oom");
+      goto fail;
+    }
+  memcpy (store, index_path, dir);
+  strcpy (store + dir, line + 2);
+  sprintf (tmp, "%s/zlib-trace.XXXXXX", tmpdir);
+  fd = mkstemp (tmp);
+  if (fd == -1)
+    {
+      trace_fail (trace, "could not create %s", tmp);
+      goto fail;
+    }
+  unlink (tmp); /* ignore rc */
+  while ((ret = fscanf (index, "%" SCNx64 " %zu", &hash, &len)) == 2)
+    {
+      if (len > CHUNK_MAX_SIZE)
+        {
+          trace_fail (trace, "%s: chunk %016" PRIx64 " is too large",
+                      index_path, hash);
+          goto fail;
+        }
+      if (copy_chunk (trace, fd, store, hash, len, buf) != EXIT_SUCCESS)
+        goto fail;
+    }
+  if (ret != EOF)
+    {
+      trace_fail (trace, "%s: malformed chunk list", index_path);
+      goto fail;
+    }
+  ret = map_fd (trace, file, fd, index_path);
+  fd = -1;
+  goto out;
+fail:
+  ret = EXIT_FAILURE;
+out:
+  if (fd != -1)
+    close (fd);
+  free (buf);
+  free (tmp);
+  free (store);
+  free (line);
+  fclose (index);
+  return ret;
+}
+
+/* NAME.in or NAME.out, or their deduplicated NAME.in.chunks or .out.chunks. */
+static int
+map_payload (struct trace *trace, struct trace_file *file, const char *path,
+             const char *suffix)
+{
+  char *buf;
+  int ret;
+
+  buf = malloc (strlen (path) + strlen (suffix) + sizeof (CHUNK_SUFFIX));
+  if (!buf)
+    return trace_fail (trace, "oom");
+  sprintf (buf, "%s%s", path, suffix);
+  if (access (buf, F_OK) == 0)
+    ret = map_file (trace, file, buf);
+  else
+    {
+      strcat (buf, CHUNK_SUFFIX);
+      if (access (buf, F_OK) == 0)
+        ret = assemble_file (trace, file, buf);
+      else
+        ret = trace_fail (trace, "could not open %s%s", path, suffix);
+    }
+  free (buf);
+  return ret;
+}
+
+/* Drop the pages of whole RELEASE_SIZE blocks before pos. */
+static void
+release_file (struct trace_file *file, uint64_t pos, uint64_t *released)
+{
+  uint64_t end = pos & ~(RELEASE_SIZE - 1);
+
+  if (end > *released)
+    {
+      madvise ((void *)(file->data + *released), end - *released,
+               MADV_DONTNEED); /* ignore rc */
+      *released = end;
+    }
+}
+
+void
+trace_release (const Bytef *data, size_t len)
+{
+  uintptr_t page = (uintptr_t)sysconf (_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t)data + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)data + len) & ~(page - 1);
+
+  if (end > start)
+    madvise ((void *)start, end - start, MADV_DONTNEED); /* ignore rc */
+}
+
+static int
+is_space (int c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static void
+skip_space (struct trace *trace)
+{
+  while (trace->meta_pos < trace->meta.len
+         && is_space (trace->meta.data[trace->meta_pos]))
+    trace->meta_pos++;
+}
+
+/* Read a single non-space character. */
+static int
+parse_char (struct trace *trace, char *c)
+{
+  skip_space (trace);
+  if (trace->meta_pos == trace->meta.len)
+    return EXIT_FAILURE;
+  *c = (char)trace->meta.data[trace->meta_pos++];
+  return EXIT_SUCCESS;
+}
+
+/* A number in C syntax, as its sign and magnitude. */
+static int
+parse_number (struct trace *trace, int *negative, uint64_t *magnitude)
+{
+  const Bytef *p;
+  const Bytef *end;
+  uint64_t v = 0;
+  int base = 10;
+  int digit;
+  int digits = 0;
+
+  skip_space (trace);
+  p = trace->meta.data + trace->meta_pos;
+  end = trace->meta.data + trace->meta.len;
+  *negative = 0;
+  if (p < end && (*p == '-' || *p == '+'))
+    *negative = *p++ == '-';
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+      base = 16;
+      p += 2;
+    }
+  else if (p < end && *p == '0')
+    base = 8;
+  for (; p < end; p++, digits++)
+    {
+      if (*p >= '0' && *p <= '9')
+        digit = *p - '0';
+      else if (*p >= 'a' && *p <= 'f')
+        digit = *p - 'a' + 10;
+      else if (*p >= 'A' && *p <= 'F')
+        digit = *p - 'A' + 10;
+      else
+        break;
+      if (digit >= base)
+        break;
+      if (v > (UINT64_MAX - digit) / base)
+        return EXIT_FAILURE;
+      v = v * base + digit;
+    }
+  if (digits == 0)
+    return EXIT_FAILURE;
+  trace->meta_pos = p - trace->meta.data;
+  *magnitude = v;
+  return EXIT_SUCCESS;
+}
+
+static int
+parse_i64 (struct trace *trace, int64_t *value)
+{
+  uint64_t v;
+  int negative;
+
+  if (parse_number (trace, &negative, &v) != EXIT_SUCCESS
+      || v > (uint64_t)INT64_MAX + negative)
+    return EXIT_FAILURE;
+  *value = negative ? (int64_t)(0 - v) : (int64_t)v;
+  return EXIT_SUCCESS;
+}
+
+static int
+parse_int (struct trace *trace, int *value)
+{
+  int64_t v;
+
+  if (parse_i64 (trace, &v) != EXIT_SUCCESS || v < INT_MIN || v > INT_MAX)
+    return EXIT_FAILURE;
+  *value = (int)v;
+  return EXIT_SUCCESS;
+}
+
+static int
+parse_uint (struct trace *trace, uInt *value)
+{
+  int64_t v;
+
+  if (parse_i64 (trace, &v) != EXIT_SUCCESS || v < 0 || v > UINT32_MAX)
+    return EXIT_FAILURE;
+  *value = (uInt)v;
+  return EXIT_SUCCESS;
+}
+
+static int
+parse_u64 (struct trace *trace, uint64_t *value)
+{
+  uint64_t v;
+  int negative;
+
+  if (parse_number (trace, &negative, &v) != EXIT_SUCCESS
+      || (negative && v != 0))
+    return EXIT_FAILURE;
+  *value = v;
+  return EXIT_SUCCESS;
+}
+
+/* Copy paths are relative to the directory of the trace that has them. */
+static int
+parse_copy_path (struct trace *trace, const char *path)
+{
+  size_t dir = dir_len (path);
+  size_t start;
+  size_t len;
+
+  skip_space (trace);
+  start = trace->meta_pos;
+  while (trace->meta_pos < trace->meta.len
+         && !is_space (trace->meta.data[trace->meta_pos]))
+    trace->meta_pos++;
+  len = trace->meta_pos - start;
+  if (len == 0)
+    return EXIT_FAILURE;
+  if (trace->meta.data[start] == '/')
+    dir = 0;
+  trace->init.copy_path = malloc (dir + len + 1);
+  if (!trace->init.copy_path)
+    return EXIT_FAILURE;
+  memcpy (trace->init.copy_path, path, dir);
+  memcpy (trace->init.copy_path + dir, trace->meta.data + start, len);
+  trace->init.copy_path[dir + len] = 0;
+  return EXIT_SUCCESS;
+}
+
+static int
+parse_init (struct trace *trace, const char *path)
+{
+  struct trace_init *init = &trace->init;
+  const char *func;
+
+  memset (init, 0, sizeof (*init));
+  init->level = Z_DEFAULT_COMPRESSION;
+  init->zmethod = Z_DEFLATED;
+  init->window_bits = MAX_WBITS;
+  init->mem_level = 8;
+  init->strategy = Z_DEFAULT_STRATEGY;
+  if (parse_char (trace, &init->kind) != EXIT_SUCCESS)
+    return trace_fail (trace, "could not read stream type");
+  if (parse_char (trace, &init->method) != EXIT_SUCCESS)
+    return trace_fail (trace, "could not read init method");
+  if (init->kind == 'd' && init->method == '1')
+    {
+      if (parse_int (trace, &init->level) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read deflateInit arguments");
+    }
+  else if (init->kind == 'd' && init->method == '2')
+    {
+      if (parse_int (trace, &init->level) != EXIT_SUCCESS
+          || parse_int (trace, &init->zmethod) != EXIT_SUCCESS
+          || parse_int (trace, &init->window_bits) != EXIT_SUCCESS
+          || parse_int (trace, &init->mem_level) != EXIT_SUCCESS
+          || parse_int (trace, &init->strategy) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read deflateInit2 arguments");
+    }
+  else if (init->kind == 'i' && init->method == '1')
+    {
+    }
+  else if (init->kind == 'i' && init->method == '2')
+    {
+      if (parse_int (trace, &init->window_bits) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read inflateInit2 argument");
+    }
+  else if ((init->kind == 'd' || init->kind == 'i') && init->method == 'c')
+    {
+      func = init->kind == 'd' ? "deflateCopy" : "inflateCopy";
+      if (parse_copy_path (trace, path) != EXIT_SUCCESS
+          || parse_u64 (trace, &init->copy_offset) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read %s arguments", func);
+    }
+  else
+    return trace_fail (trace, "unsupported stream kind and init method");
+  return EXIT_SUCCESS;
+}
+
+int
+trace_open (struct trace *trace, const char *path)
+{
+  memset (trace, 0, sizeof (*trace));
+  if (map_file (trace, &trace->meta, path) != EXIT_SUCCESS)
+    goto fail;
+  if (map_payload (trace, &trace->in, path, ".in") != EXIT_SUCCESS)
+    goto fail_unmap_meta;
+  if (map_payload (trace, &trace->out, path, ".out") != EXIT_SUCCESS)
+    goto fail_unmap_in;
+  if (parse_init (trace, path) != EXIT_SUCCESS)
+    goto fail_unmap_out;
+  return EXIT_SUCCESS;
+fail_unmap_out:
+  unmap_file (&trace->out);
+fail_unmap_in:
+  unmap_file (&trace->in);
+fail_unmap_meta:
+  unmap_file (&trace->meta);
+fail:
+  return EXIT_FAILURE;
+}
+
+uint64_t
+trace_offset (struct trace *trace)
+{
+  skip_space (trace);
+  return trace->meta_pos;
+}
+
+int
+trace_next (struct trace *trace, struct trace_record *record, int *eof)
+{
+  struct trace_call *call = &record->call;
+  struct trace_mem *mem = &record->mem;
+  struct trace_time *time = &record->time;
+  char kind;
+  const char *func;
+
+  record->offset = trace_offset (trace);
+  if (trace->meta_pos == trace->meta.len)
+    {
+      *eof = 1;
+      return EXIT_SUCCESS;
+    }
+  if (parse_char (trace, &kind) != EXIT_SUCCESS)
+    return trace_fail (trace, "could not read record kind");
+  if (kind == 'm')
+    {
+      record->type = TRACE_MEM;
+      if (parse_u64 (trace, &mem->allocs) != EXIT_SUCCESS
+          || parse_u64 (trace, &mem->bytes) != EXIT_SUCCESS
+          || parse_u64 (trace, &mem->peak) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read memory usage");
+      return EXIT_SUCCESS;
+    }
+  if (kind == 'x')
+    {
+      record->type = TRACE_CUT;
+      return EXIT_SUCCESS;
+    }
+  if (kind == 't')
+    {
+      record->type = TRACE_TIME;
+      if (parse_u64 (trace, &time->tid) != EXIT_SUCCESS
+          || parse_u64 (trace, &time->start_ns) != EXIT_SUCCESS
+          || parse_u64 (trace, &time->duration_ns) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read call timing");
+      return EXIT_SUCCESS;
+    }
+  record->type = TRACE_CALL;
+  call->kind = kind;
+  switch (kind)
+    {
+    case 'p':
+      func = "deflateParams";
+      if (parse_int (trace, &call->level) != EXIT_SUCCESS
+          || parse_int (trace, &call->strategy) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read %s arguments", func);
+      break;
+    case 'c':
+      func = trace->init.kind == 'd' ? "deflate" : "inflate";
+      if (parse_int (trace, &call->flush) != EXIT_SUCCESS)
+        return trace_fail (trace, "could not read %s arguments", func);
+      break;
+    case 'r':
+      func = trace->init.kind == 'd' ? "deflateReset" : "inflateReset";
+      break;
+    default:
+      return trace_fail (trace, "unsupported call kind");
+    }
+  if (parse_u64 (trace, &call->next_in) != EXIT_SUCCESS
+      || parse_uint (trace, &call->avail_in) != EXIT_SUCCESS
+      || parse_u64 (trace, &call->next_out) != EXIT_SUCCESS
+      || parse_uint (trace, &call->avail_out) != EXIT_SUCCESS)
+    return trace_fail (trace, "could not read stream pointers");
+  if (parse_uint (trace, &call->consumed_in) != EXIT_SUCCESS
+      || parse_uint (trace, &call->consumed_out) != EXIT_SUCCESS
+      || parse_int (trace, &call->err) != EXIT_SUCCESS)
+    return trace_fail (trace, "could not read %s results", func);
+  if (call->consumed_in > trace->in.len - trace->in_pos)
+    return trace_fail (trace, "input file is truncated");
+  if (call->consumed_out > trace->out.len - trace->out_pos)
+    return trace_fail (trace, "output file is truncated");
+  call->in.data = trace->in.data + trace->in_pos;
+  call->in.len = trace->in.len - trace->in_pos;
+  if (call->in.len > call->avail_in)
+    call->in.len = call->avail_in;
+  call->out.data = trace->out.data + trace->out_pos;
+  call->out.len = call->consumed_out;
+  release_file (&trace->meta, trace->meta_pos, &trace->meta_released);
+  release_file (&trace->in, trace->in_pos, &trace->in_released);
+  release_file (&trace->out, trace->out_pos, &trace->out_released);
+  trace->in_pos += call->consumed_in;
+  trace->out_pos += call->consumed_out;
+  return EXIT_SUCCESS;
+}
+
+void
+trace_close (struct trace *trace)
+{
+  free (trace->init.copy_path);
+  trace->init.copy_path = NULL;
+  unmap_file (&trace->out);
+  unmap_file (&trace->in);
+  unmap_file (&trace->meta);
+}
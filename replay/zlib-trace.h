@@ -0,0 +1,130 @@
+#ifndef ZLIB_TRACE_H
+#define ZLIB_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/*
+ * Streaming reader for {deflate | inflate}.PID.STREAM traces.
+ *
+ * The metadata, input and output files are mapped into memory, and records
+ * are parsed on demand.  Data is never copied: the views in trace_call
+ * point into the mappings and stay valid until trace_close ().  Memory use
+ * stays flat however large the trace is: the pages that were read past are
+ * released, and fault back in from the files if a view is accessed again.
+ *
+ * Functions return EXIT_SUCCESS or EXIT_FAILURE; on failure, trace->error
+ * describes the problem.
+ */
+
+struct trace_view
+{
+  const Bytef *data;
+  size_t len;
+};
+
+struct trace_init
+{
+  char kind;   /* 'd' or 'i' */
+  char method; /* '1' (xxxInit), '2' (xxxInit2) or 'c' (xxxCopy) */
+  /* Unused parameters have their zlib default values. */
+  int level;
+  int zmethod;
+  int window_bits;
+  int mem_level;
+  int strategy;
+  /* Copies only: the trace to replay up to copy_offset. */
+  char *copy_path;
+  uint64_t copy_offset;
+};
+
+enum trace_record_type
+{
+  TRACE_CALL,
+  TRACE_MEM,
+  TRACE_TIME,
+  TRACE_CUT, /* the stream went on after the trace ended */
+};
+
+struct trace_call
+{
+  char kind; /* 'c' (deflate or inflate), 'p' (deflateParams), 'r' (reset) */
+  int flush;
+  int level;
+  int strategy;
+  uint64_t next_in;
+  uInt avail_in;
+  uint64_t next_out;
+  uInt avail_out;
+  uInt consumed_in;
+  uInt consumed_out;
+  int err;
+  /* Input available to the call, truncated at the end of the input file. */
+  struct trace_view in;
+  /* Output that the call produced. */
+  struct trace_view out;
+};
+
+struct trace_mem
+{
+  uint64_t allocs;
+  uint64_t bytes;
+  uint64_t peak;
+};
+
+/* Follows the call it describes. */
+struct trace_time
+{
+  uint64_t tid;
+  uint64_t start_ns; /* CLOCK_MONOTONIC */
+  uint64_t duration_ns;
+};
+
+struct trace_record
+{
+  enum trace_record_type type;
+  uint64_t offset; /* in the metadata file */
+  union
+  {
+    struct trace_call call;
+    struct trace_mem mem;
+    struct trace_time time;
+  };
+};
+
+struct trace_file
+{
+  const Bytef *data;
+  size_t len;
+};
+
+struct trace
+{
+  struct trace_file meta;
+  struct trace_file in;
+  struct trace_file out;
+  uint64_t meta_pos;
+  uint64_t in_pos;
+  uint64_t out_pos;
+  /* Mapped data up to these offsets has been given back to the kernel. */
+  uint64_t meta_released;
+  uint64_t in_released;
+  uint64_t out_released;
+  struct trace_init init;
+  char error[256];
+};
+
+int trace_open (struct trace *trace, const char *path);
+/* Offset of the next record in the metadata file. */
+uint64_t trace_offset (struct trace *trace);
+/* Sets *eof instead of filling the record when there are no more records. */
+int trace_next (struct trace *trace, struct trace_record *record, int *eof);
+/*
+ * Give the whole pages of a view back to the kernel, for calls that are
+ * too large to keep in memory at once.
+ */
+void trace_release (const Bytef *data, size_t len);
+void trace_close (struct trace *trace);
+
+#endif